@@ -0,0 +1,795 @@
+/*
+ * Benchmark and differential fuzz harness for the piece tree core
+ *
+ *     ./build.sh bench
+ *     ./hexwrench-bench fuzz [seed] [rounds]
+ *     ./hexwrench-bench bench [max edits] [max size in MiB]
+ *
+ * fuzz runs random edit sequences against a flat reference buffer and
+ * checks every read byte for byte, on both mapped and paged sources. bench
+ * reports ns/op for inserts, deletes and screen-sized reads.
+ */
+
+#define HEXWRENCH_NO_MAIN
+#define CRC_MIN_CHUNK_LEN 4096
+#include "main.c"
+
+#include <sys/wait.h>
+
+static uint64_t rng_state = 1;
+
+static uint64_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t rng_below(uint64_t n) {
+    return n ? rng() % n : 0;
+}
+
+// Makes an unlinked file of size bytes, only the first fill_len of them actually written
+static int make_input(uint64_t size, uint64_t fill_len, uint8_t *ref) {
+    const char *dir = getenv("TMPDIR");
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s/hexwrench-bench.XXXXXX", dir ? dir : "/tmp");
+
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(name);
+
+    uint8_t *buf = malloc(SAVE_BUF_LEN);
+    for (uint64_t off = 0; off < fill_len; off += SAVE_BUF_LEN) {
+        uint64_t len = MIN(SAVE_BUF_LEN, fill_len - off);
+        for (uint64_t i = 0; i < len; i++) {
+            buf[i] = rng_below(4) ? 'a' + rng_below(4) : rng();
+        }
+        if (ref) {
+            memcpy(ref + off, buf, len);
+        }
+        if (!write_all(fd, off, buf, len)) {
+            perror("write");
+            exit(1);
+        }
+    }
+    free(buf);
+
+    if (ftruncate(fd, size)) {
+        perror("ftruncate");
+        exit(1);
+    }
+    return fd;
+}
+
+static void open_view(ViewState *v, int fd, uint64_t size, bool paged, uint64_t cache_pages) {
+    static char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    *v = (ViewState){0};
+    if (!open_file(&v->file, path)) {
+        exit(1);
+    }
+
+    if (paged && v->file.kind == SOURCE_MMAP) {
+        if (v->file.data) {
+            munmap(v->file.data, v->file.size);
+        }
+        v->file.data = NULL;
+        v->file.kind = SOURCE_PAGED;
+        page_cache_init(&v->file.cache, cache_pages);
+    }
+
+    insert_data(v, 0, file_block(0, size));
+    commit_edit(v, 0);
+}
+
+/*
+ * Fuzzing
+ *
+ * The reference is a plain byte array edited with memmove. Snapshots of it
+ * are kept for recent versions so undo and redo can be checked as well.
+ */
+
+#define FUZZ_OPS 2000
+#define FUZZ_SNAPSHOTS 64
+
+typedef struct {
+    uint8_t *data;
+    uint64_t len;
+    uint64_t cap;
+} Bytes;
+
+typedef struct {
+    Bytes *data;
+    uint64_t len;
+    uint64_t cap;
+} BytesArr;
+
+static uint64_t fuzz_seed;
+static uint64_t fuzz_round;
+static uint64_t fuzz_op;
+
+static void fuzz_fail(const char *what) {
+    printf("FAIL seed %llu round %llu op %llu: %s\n", fuzz_seed, fuzz_round, fuzz_op, what);
+    exit(1);
+}
+
+static void bytes_replace(Bytes *b, uint64_t offset, uint64_t len, const uint8_t *data, uint64_t data_len) {
+    uint64_t new_len = b->len - len + data_len;
+    if (new_len > b->cap) {
+        b->cap = MAX(new_len, b->cap * 2);
+        b->data = realloc(b->data, b->cap);
+    }
+    memmove(b->data + offset + data_len, b->data + offset + len, b->len - offset - len);
+    if (data_len) {
+        memcpy(b->data + offset, data, data_len);
+    }
+    b->len = new_len;
+}
+
+static Bytes bytes_copy(Bytes *b) {
+    Bytes copy = {.data = malloc(MAX(b->len, 1)), .len = b->len, .cap = MAX(b->len, 1)};
+    memcpy(copy.data, b->data, b->len);
+    return copy;
+}
+
+// Checks the cached sizes, counts and heights, and that the tree is still an AVL tree
+static void check_tree(PieceNode *n) {
+    if (!n) {
+        return;
+    }
+
+    check_tree(n->left);
+    check_tree(n->right);
+
+    int balance = piece_height(n->left) - piece_height(n->right);
+    if (!n->block.len) {
+        fuzz_fail("empty piece in tree");
+    }
+    if (n->size != piece_size(n->left) + n->block.len + piece_size(n->right) ||
+        n->count != piece_count(n->left) + 1 + piece_count(n->right) ||
+        n->height != MAX(piece_height(n->left), piece_height(n->right)) + 1 ||
+        balance < -1 || balance > 1) {
+        fuzz_fail("tree invariant broken");
+    }
+}
+
+static void check_view(ViewState *v, Bytes *ref) {
+    if (get_total_size(v) != ref->len) {
+        fuzz_fail("size mismatch");
+    }
+    check_tree(v->blocks.root);
+
+    uint8_t *buf = malloc(ref->len + 1);
+    if (!get_data(v, 0, buf, ref->len) || memcmp(buf, ref->data, ref->len)) {
+        fuzz_fail("full read mismatch");
+    }
+
+    // Short reads at random offsets exercise the seek and the piece-boundary math
+    for (int i = 0; i < 8 && ref->len; i++) {
+        uint64_t offset = rng_below(ref->len);
+        uint64_t len = 1 + rng_below(MIN(ref->len - offset, 4096));
+        if (!get_data(v, offset, buf, len) || memcmp(buf, ref->data + offset, len)) {
+            fuzz_fail("partial read mismatch");
+        }
+    }
+    free(buf);
+}
+
+static uint64_t naive_search(Bytes *ref, uint8_t *pat, uint64_t pat_len, uint64_t start, uint64_t end) {
+    for (uint64_t i = start; i < end && i + pat_len <= ref->len; i++) {
+        if (!memcmp(ref->data + i, pat, pat_len)) {
+            return i;
+        }
+    }
+    return NO_MATCH;
+}
+
+static void check_search(ViewState *v, Bytes *ref) {
+    for (int i = 0; i < 4 && ref->len; i++) {
+        uint8_t pat[64];
+        uint64_t pat_len = 1 + rng_below(MIN(ref->len, sizeof(pat)));
+        uint64_t from = rng_below(ref->len - pat_len + 1);
+        memcpy(pat, ref->data + from, pat_len);
+        if (rng_below(4) == 0) {
+            pat[rng_below(pat_len)] ^= 1;
+        }
+
+        uint64_t start = rng_below(ref->len);
+        uint64_t end = start + rng_below(ref->len - start + 1);
+        uint64_t got = search_range(&v->blocks, &v->file, &v->file.cache, pat, pat_len, start, end);
+        if (got != naive_search(ref, pat, pat_len, start, end)) {
+            fuzz_fail("search mismatch");
+        }
+    }
+}
+
+// Piece CRCs against a straight CRC of the reference, plus one streamed hash each time
+static void check_checksums(ViewState *v, Bytes *ref) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t start = i ? rng_below(ref->len + 1) : 0;
+        uint64_t end = i ? start + rng_below(ref->len - start + 1) : ref->len;
+
+        uint32_t got;
+        if (!crc_range(&crc_job, v, start, end, &got)) {
+            fuzz_fail("crc table not ready");
+        }
+        if (got != crc32c_extend(0, ref->data + start, end - start)) {
+            fuzz_fail("crc mismatch");
+        }
+    }
+
+    uint64_t start = rng_below(ref->len + 1);
+    uint64_t end = start + rng_below(ref->len - start + 1);
+    hash_start(&hash_job, v, HASH_SHA256, start, end);
+    while (!atomic_load(&hash_job.done)) {
+        usleep(100);
+    }
+    hash_update(&hash_job);
+
+    Sha256 sha;
+    uint8_t want[32];
+    sha256_init(&sha);
+    sha256_update(&sha, ref->data + start, end - start);
+    sha256_final(&sha, want);
+    if (hash_job.digest_len != 32 || memcmp(hash_job.digest, want, 32)) {
+        fuzz_fail("sha256 mismatch");
+    }
+}
+
+static uint64_t random_len(void) {
+    switch (rng_below(8)) {
+        case 0:  return 1;
+        case 1:  return 1 + rng_below(100000);
+        default: return 1 + rng_below(64);
+    }
+}
+
+// Somewhere in a document of len bytes, now and then right at the end where deletes and overwrites have nothing to take
+static uint64_t random_offset(uint64_t len) {
+    return rng_below(16) ? rng_below(len + 1) : len;
+}
+
+static void random_bytes(uint8_t *buf, uint64_t len) {
+    for (uint64_t i = 0; i < len; i++) {
+        buf[i] = 'a' + rng_below(4);
+    }
+}
+
+// Resumes a second view from the journal as if the session had crashed just now
+static void check_resume(Journal *j, char *journal_base, int fd, uint64_t size, bool paged, Bytes *ref) {
+    if (j->fd < 0) {
+        fuzz_fail("journal stopped");
+    }
+
+    // A crash partway through a record leaves a torn tail, which the resume has to drop
+    uint8_t torn[sizeof(JournalRecord) + sizeof(JournalEdit) + 8];
+    uint64_t torn_len = rng_below(sizeof(torn));
+    random_bytes(torn, torn_len);
+    if (!write_all(j->fd, j->end, torn, torn_len)) {
+        fuzz_fail("torn write failed");
+    }
+
+    ViewState resumed;
+    open_view(&resumed, fd, size, paged, 1 + rng_below(8));
+    char *source_name = resumed.file.name;
+    resumed.file.name = journal_base;
+
+    Journal rj = {.fd = -1};
+    if (!journal_open(&rj, &resumed, true)) {
+        fuzz_fail("resume failed");
+    }
+    check_view(&resumed, ref);
+
+    // The original session carries on writing right where the resume cut the torn tail off
+    if (rj.end != j->end) {
+        fuzz_fail("resume kept a torn record");
+    }
+    close(rj.fd);
+    free(rj.w.buf);
+
+    resumed.file.name = source_name;
+    if (resumed.file.data) {
+        munmap(resumed.file.data, resumed.file.size);
+    }
+    page_cache_free(&resumed.file.cache);
+    close(resumed.file.fd);
+}
+
+// A handful of non-overlapping edits, handed to apply_batch in shuffled order
+static void fuzz_batch(ViewState *v, Bytes *ref) {
+    EditArr edits = {0};
+    uint64_t count = 1 + rng_below(16);
+
+    uint64_t *cuts = malloc(sizeof(uint64_t) * count);
+    for (uint64_t i = 0; i < count; i++) {
+        cuts[i] = rng_below(ref->len + 1);
+    }
+    for (uint64_t i = 1; i < count; i++) {
+        for (uint64_t j = i; j && cuts[j - 1] > cuts[j]; j--) {
+            uint64_t tmp = cuts[j];
+            cuts[j] = cuts[j - 1];
+            cuts[j - 1] = tmp;
+        }
+    }
+
+    // Build the expected result front to back, reading the old reference
+    Bytes expect = {.data = malloc(1), .cap = 1};
+    uint64_t pos = 0;
+    uint8_t data[64];
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t offset = MAX(cuts[i], pos);
+        uint64_t next = (i + 1 < count) ? cuts[i + 1] : ref->len;
+        uint64_t len = rng_below(2) ? 0 : rng_below(MIN(next, ref->len) - MIN(offset, next) + 1);
+        uint64_t data_len = rng_below(3) ? 1 + rng_below(sizeof(data)) : 0;
+        if (!len && !data_len) {
+            data_len = 1;
+        }
+        random_bytes(data, data_len);
+
+        bytes_replace(&expect, expect.len, 0, ref->data + pos, offset - pos);
+        bytes_replace(&expect, expect.len, 0, data, data_len);
+        pos = offset + len;
+
+        Edit e = {.offset = offset, .len = len, .seq = i};
+        e.block = data_len ? add_bytes(&v->add, data, data_len) : new_block(NULL, 0, false);
+        ARR_APPEND(&edits, e);
+    }
+    bytes_replace(&expect, expect.len, 0, ref->data + pos, ref->len - pos);
+
+    for (uint64_t i = edits.len; i > 1; i--) {
+        uint64_t j = rng_below(i);
+        Edit tmp = edits.data[i - 1];
+        edits.data[i - 1] = edits.data[j];
+        edits.data[j] = tmp;
+    }
+
+    Edit *bad = NULL;
+    if (!apply_batch(v, &edits, &bad)) {
+        fuzz_fail("batch rejected");
+    }
+
+    free(ref->data);
+    *ref = expect;
+    free(edits.data);
+    free(cuts);
+}
+
+static void fuzz_one(bool paged) {
+    uint64_t size = rng_below(4) ? rng_below(256 * 1024) : rng_below(64);
+
+    Bytes ref = {.data = malloc(MAX(size, 1)), .len = size, .cap = MAX(size, 1)};
+    int fd = make_input(size, size, ref.data);
+
+    ViewState v;
+    open_view(&v, fd, size, paged, 1 + rng_below(8));
+    check_view(&v, &ref);
+
+    // The journal goes next to a made up name, the source itself is unlinked
+    const char *dir = getenv("TMPDIR");
+    char journal_base[PATH_MAX];
+    snprintf(journal_base, sizeof(journal_base), "%s/hexwrench-bench-journal.%d", dir ? dir : "/tmp", getpid());
+    char *source_name = v.file.name;
+    v.file.name = journal_base;
+    Journal j = {.fd = -1};
+    if (!journal_open(&j, &v, false) || j.fd < 0) {
+        fuzz_fail("journal didn't open");
+    }
+
+    crc_start(&crc_job, &v.file);
+    while (!crc_ready(&crc_job)) {
+        usleep(100);
+    }
+    crc_update(&crc_job);
+
+    // snapshots.data[i] is the reference for history version i, freed once it's too old to undo to
+    BytesArr snapshots = {0};
+    ARR_APPEND(&snapshots, bytes_copy(&ref));
+    Bytes clip = {0};
+
+    for (fuzz_op = 0; fuzz_op < FUZZ_OPS; fuzz_op++) {
+        uint8_t data[100000];
+        uint64_t cursor = 0;
+        bool edited = true;
+        bool save = false;
+        bool resume = fuzz_op % 128 == 127;
+        uint64_t journal_end = j.end;
+
+        switch (rng_below(16)) {
+            case 0: case 1: case 2: {
+                uint64_t offset = rng_below(ref.len + 1);
+                uint64_t len = random_len();
+                random_bytes(data, len);
+                Block block = add_bytes(&v.add, data, len);
+                insert_data(&v, offset, block);
+                journal_insert(&j, &v, offset, block);
+                bytes_replace(&ref, offset, 0, data, len);
+                cursor = offset;
+            } break;
+            case 3: case 4: {
+                uint64_t offset = random_offset(ref.len);
+                uint64_t len = random_len();
+                delete_data(&v, offset, len);
+                journal_delete(&j, &v, offset, len);
+                if (offset < ref.len) {
+                    bytes_replace(&ref, offset, MIN(len, ref.len - offset), NULL, 0);
+                }
+                cursor = offset;
+            } break;
+            case 5: case 6: {
+                uint64_t offset = random_offset(ref.len);
+                uint64_t len = random_len();
+                random_bytes(data, len);
+                overwrite_data(&v, offset, data, len);
+                journal_overwrite(&j, &v, offset, data, len);
+                if (offset < ref.len) {
+                    bytes_replace(&ref, offset, MIN(len, ref.len - offset), data, MIN(len, ref.len - offset));
+                }
+                cursor = offset;
+            } break;
+            case 7: {
+                fuzz_batch(&v, &ref);
+                journal_checkpoint(&j, &v);
+            } break;
+            case 8: {
+                compact_step(&v, 1 + rng_below(64));
+                edited = false;
+            } break;
+            case 9: case 10: {
+                edited = false;
+                uint64_t steps = 1 + rng_below(4);
+                PieceTree before = v.blocks;
+                for (uint64_t i = 0; i < steps && v.version && snapshots.data[v.version - 1].data; i++) {
+                    if (!undo_edit(&v, &cursor)) {
+                        fuzz_fail("undo refused");
+                    }
+                    free(ref.data);
+                    ref = bytes_copy(&snapshots.data[v.version]);
+                }
+                journal_splice(&j, &v, &before);
+
+                // Older versions read bytes an in-place save replaced on disk, which the journal has to carry
+                resume |= v.file.overwritten.len > 0;
+            } break;
+            case 11: {
+                edited = false;
+                uint64_t steps = 1 + rng_below(4);
+                PieceTree before = v.blocks;
+                for (uint64_t i = 0; i < steps && v.version + 1 < v.history.len; i++) {
+                    if (!redo_edit(&v, &cursor)) {
+                        fuzz_fail("redo refused");
+                    }
+                    free(ref.data);
+                    ref = bytes_copy(&snapshots.data[v.version]);
+                }
+                journal_splice(&j, &v, &before);
+            } break;
+            case 12: {
+                // Zeros or a short pattern, sometimes long enough to wrap around a tile several times
+                uint8_t pattern[FILL_MAX_PERIOD];
+                uint64_t offset = rng_below(ref.len + 1);
+                uint64_t len = rng_below(4) ? random_len() : 1 + rng_below(4 * FILL_TILE_LEN);
+                uint64_t period = 1 + rng_below(rng_below(2) ? 4 : FILL_MAX_PERIOD);
+                if (rng_below(3)) {
+                    random_bytes(pattern, period);
+                } else {
+                    memset(pattern, 0, period);
+                }
+                fill_data(&v, offset, len, pattern, period);
+                journal_fill(&j, &v, offset, len, pattern, period);
+                if (offset < ref.len) {
+                    len = MIN(len, ref.len - offset);
+                    uint8_t *filled = malloc(len);
+                    for (uint64_t i = 0; i < len; i++) {
+                        filled[i] = pattern[i % period];
+                    }
+                    bytes_replace(&ref, offset, len, filled, len);
+                    free(filled);
+                }
+                cursor = offset;
+            } break;
+            case 13: {
+                // Patterns lifted from the document, short enough to match often and to overlap themselves
+                v.search_len = 3 + rng_below(6);
+                random_bytes(v.search, v.search_len);
+                if (ref.len >= v.search_len) {
+                    memcpy(v.search, ref.data + rng_below(ref.len - v.search_len + 1), v.search_len);
+                }
+                uint64_t repl_len = rng_below(8);
+                random_bytes(data, repl_len);
+
+                uint64_t first = 0;
+                uint64_t count = 0;
+                Block repl = add_bytes(&v.add, data, repl_len);
+                if (!replace_all(&v, &search_job, repl, &count, &first)) {
+                    fuzz_fail("replace_all failed");
+                }
+                if (count) {
+                    journal_replace_all(&j, &v, search_job.pat, search_job.pat_len, repl, count);
+                }
+
+                Bytes out = {0};
+                uint64_t want = 0;
+                uint64_t copied = 0;
+                for (uint64_t i = 0; i + v.search_len <= ref.len;) {
+                    if (memcmp(ref.data + i, v.search, v.search_len)) {
+                        i++;
+                        continue;
+                    }
+                    bytes_replace(&out, out.len, 0, ref.data + copied, i - copied);
+                    bytes_replace(&out, out.len, 0, data, repl_len);
+                    i += v.search_len;
+                    copied = i;
+                    want++;
+                }
+                bytes_replace(&out, out.len, 0, ref.data + copied, ref.len - copied);
+                free(ref.data);
+                ref = out;
+                if (count != want) {
+                    fuzz_fail("replace count mismatch");
+                }
+                edited = count;
+                cursor = first;
+            } break;
+            case 14: {
+                // Pastes the clipboard, kept from ops back or freshly yanked or cut, sometimes more than once
+                if (!v.clipboard.root || rng_below(3)) {
+                    uint64_t offset = rng_below(ref.len + 1);
+                    uint64_t len = random_len();
+                    len = MIN(len, ref.len - offset);
+                    v.clipboard = copy_range(&v, offset, len);
+                    bytes_replace(&clip, 0, clip.len, ref.data + offset, len);
+                    if (rng_below(2)) {
+                        delete_data(&v, offset, len);
+                        journal_delete(&j, &v, offset, len);
+                        bytes_replace(&ref, offset, len, NULL, 0);
+                    }
+                }
+                if (piece_size(v.clipboard.root) != clip.len) {
+                    fuzz_fail("clipboard size mismatch");
+                }
+
+                uint64_t offset = rng_below(ref.len + 1);
+                uint64_t copies = 1 + rng_below(3);
+                for (uint64_t i = 0; i < copies; i++) {
+                    paste_data(&v, offset, &v.clipboard);
+                    journal_paste(&j, &v, offset, &v.clipboard);
+                    bytes_replace(&ref, offset, 0, clip.data, clip.len);
+                }
+                cursor = offset;
+            } break;
+            case 15: {
+                // Saves in place, first rewriting the document from where its pieces stop lining up with the source
+                save = v.file.writable;
+                edited = !can_save_in_place(&v);
+                if (save && edited) {
+                    uint64_t keep = MIN(ref.len, size);
+                    PieceIter it;
+                    for (piece_iter_seek(&it, &v.blocks, 0); piece_iter_block(&it) && it.offset < keep; piece_iter_next(&it)) {
+                        Block *b = piece_iter_block(&it);
+                        if (!b->patch && b->start != it.offset) {
+                            keep = it.offset;
+                        }
+                    }
+
+                    uint64_t kept = MIN(ref.len, size) - keep;
+                    uint8_t *tail = malloc(MAX(size - keep, 1));
+                    memcpy(tail, ref.data + keep, kept);
+                    random_bytes(tail + kept, size - keep - kept);
+
+                    uint64_t old_len = ref.len;
+                    delete_data(&v, keep, old_len - keep);
+                    journal_delete(&j, &v, keep, old_len - keep);
+                    if (size > keep) {
+                        Block block = add_bytes(&v.add, tail, size - keep);
+                        insert_data(&v, keep, block);
+                        journal_insert(&j, &v, keep, block);
+                    }
+                    bytes_replace(&ref, keep, old_len - keep, tail, size - keep);
+                    free(tail);
+                }
+            } break;
+        }
+
+        if (edited) {
+            // An edit that changed nothing mustn't have added a record
+            if (!edit_pending(&v) && j.end != journal_end) {
+                fuzz_fail("no-op edit journaled");
+            }
+
+            uint64_t old_version = v.version;
+            commit_edit(&v, cursor);
+
+            // A new version drops the redo history, so the snapshots past it go too
+            if (v.version != old_version) {
+                for (uint64_t i = v.version; i < snapshots.len; i++) {
+                    free(snapshots.data[i].data);
+                }
+                snapshots.len = v.version;
+                ARR_APPEND(&snapshots, bytes_copy(&ref));
+            }
+            if (v.version >= FUZZ_SNAPSHOTS) {
+                Bytes *old = &snapshots.data[v.version - FUZZ_SNAPSHOTS];
+                free(old->data);
+                old->data = NULL;
+            }
+        }
+
+        if (save) {
+            if (!can_save_in_place(&v) || !save_in_place(&v)) {
+                fuzz_fail("in-place save failed");
+            }
+            journal_saved(&j, &v);
+
+            // The journal starts over from what the save put on disk, so that had better be the document
+            resume = true;
+
+            // A paged source keeps no history or clipboard past the save
+            if (paged) {
+                for (uint64_t i = 0; i < snapshots.len; i++) {
+                    free(snapshots.data[i].data);
+                }
+                snapshots.len = 0;
+                ARR_APPEND(&snapshots, bytes_copy(&ref));
+                clip.len = 0;
+            }
+
+            // The CRC table was built from source bytes the save just replaced
+            crc_start(&crc_job, &v.file);
+            while (!crc_ready(&crc_job)) {
+                usleep(100);
+            }
+            crc_update(&crc_job);
+        }
+
+        check_view(&v, &ref);
+        if (fuzz_op % 16 == 0) {
+            check_search(&v, &ref);
+            check_checksums(&v, &ref);
+        }
+        if (resume) {
+            check_resume(&j, journal_base, fd, size, paged, &ref);
+        }
+    }
+
+    crc_stop(&crc_job);
+    hash_stop(&hash_job);
+
+    journal_close(&j);
+    v.file.name = source_name;
+    close(fd);
+
+    for (uint64_t i = 0; i < snapshots.len; i++) {
+        free(snapshots.data[i].data);
+    }
+    free(snapshots.data);
+    free(clip.data);
+    free(ref.data);
+    if (v.file.data) {
+        munmap(v.file.data, v.file.size);
+    }
+    page_cache_free(&v.file.cache);
+    close(v.file.fd);
+}
+
+static int run_fuzz(uint64_t seed, uint64_t rounds) {
+    for (fuzz_round = 0; fuzz_round < rounds; fuzz_round++) {
+        fuzz_seed = seed + fuzz_round;
+        rng_state = fuzz_seed * 0x9E3779B97F4A7C15ULL + 1;
+
+        bool paged = fuzz_round % 2;
+        fuzz_one(paged);
+        printf("round %llu ok (%s)\n", fuzz_round, paged ? "paged" : "mmap");
+    }
+    return 0;
+}
+
+/*
+ * Benchmarks
+ *
+ * Every (size, edits) cell runs in its own child so the nodes the
+ * previous cell left behind (they're never freed) don't skew the next.
+ * Inputs past 1 GiB are sparse, so their tail reads back as zero pages.
+ */
+
+#define BENCH_FILL_MAX (1024ULL * 1024 * 1024)
+#define BENCH_READ_LEN 4096
+
+// Keeps the reads from being optimized out
+static volatile uint64_t bench_sink;
+
+static void bench_cell(int fd, uint64_t size, uint64_t edits) {
+    ViewState v;
+    open_view(&v, fd, size, false, 0);
+
+    // Each edit is committed like the editor does, so compaction is in the numbers
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < edits; i++) {
+        uint8_t byte = rng();
+        uint64_t offset = rng_below(get_total_size(&v) + 1);
+        insert_data(&v, offset, add_bytes(&v.add, &byte, 1));
+        commit_edit(&v, offset);
+    }
+    uint64_t insert_ns = now_ns() - start;
+    uint64_t pieces = piece_count(v.blocks.root);
+
+    static uint8_t buf[BENCH_READ_LEN];
+    uint64_t sum = 0;
+    start = now_ns();
+    for (uint64_t i = 0; i < edits; i++) {
+        uint64_t offset = rng_below(get_total_size(&v) - BENCH_READ_LEN);
+        if (!get_data(&v, offset, buf, BENCH_READ_LEN)) {
+            printf("read failed at %llu\n", offset);
+            exit(1);
+        }
+        sum += buf[i % BENCH_READ_LEN];
+    }
+    uint64_t read_ns = now_ns() - start;
+
+    start = now_ns();
+    for (uint64_t i = 0; i < edits; i++) {
+        uint64_t offset = rng_below(get_total_size(&v));
+        delete_data(&v, offset, 1);
+        commit_edit(&v, offset);
+    }
+    uint64_t delete_ns = now_ns() - start;
+
+    bench_sink = sum;
+
+    printf("%8llu MiB %9llu %12.1f %12.1f %12.1f %10llu\n",
+           size >> 20, edits,
+           (double)insert_ns / edits, (double)delete_ns / edits, (double)read_ns / edits, pieces);
+    fflush(stdout);
+}
+
+static int run_bench(uint64_t max_edits, uint64_t max_size) {
+    static const uint64_t sizes[] = {1ULL << 20, 100ULL << 20, 1ULL << 30, 10ULL << 30};
+    static const uint64_t edit_counts[] = {1000, 10000, 100000, 1000000};
+
+    printf("%12s %9s %12s %12s %12s %10s\n", "size", "edits", "insert ns/op", "delete ns/op", "read ns/op", "pieces");
+    for (uint64_t s = 0; s < sizeof(sizes) / sizeof(*sizes) && sizes[s] <= max_size; s++) {
+        int fd = make_input(sizes[s], MIN(sizes[s], BENCH_FILL_MAX), NULL);
+
+        for (uint64_t e = 0; e < sizeof(edit_counts) / sizeof(*edit_counts) && edit_counts[e] <= max_edits; e++) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                rng_state = sizes[s] ^ edit_counts[e];
+                bench_cell(fd, sizes[s], edit_counts[e]);
+                exit(0);
+            }
+
+            int status;
+            if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+                printf("cell %llu MiB / %llu edits failed\n", sizes[s] >> 20, edit_counts[e]);
+                return 1;
+            }
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && !strcmp(argv[1], "fuzz")) {
+        uint64_t seed = argc >= 3 ? strtoull(argv[2], NULL, 0) : (uint64_t)time(NULL);
+        uint64_t rounds = argc >= 4 ? strtoull(argv[3], NULL, 0) : 20;
+        printf("fuzzing from seed %llu\n", seed);
+        return run_fuzz(seed, rounds);
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "bench")) {
+        uint64_t max_edits = argc >= 3 ? strtoull(argv[2], NULL, 0) : UINT64_MAX;
+        uint64_t max_size = argc >= 4 ? strtoull(argv[3], NULL, 0) << 20 : UINT64_MAX;
+        return run_bench(max_edits, max_size);
+    }
+
+    printf("Expected %s fuzz [seed] [rounds]\n", argv[0]);
+    printf("      or %s bench [max edits] [max size in MiB]\n", argv[0]);
+    return 1;
+}
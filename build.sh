@@ -1 +1,5 @@
-clang -o hexwrench main.c
+if [ "$1" = "bench" ]; then
+    clang -O2 -o hexwrench-bench bench.c -pthread -lm
+else
+    clang -o hexwrench main.c -pthread -lm
+fi
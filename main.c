@@ -1,24 +1,39 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
 
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <linux/fs.h>
 
 #define LOG(...) fprintf(stderr, __VA_ARGS__)
 #define LOG2(...) fprintf(stderr, __VA_ARGS__)
 #undef LOG
-#define LOG(...)
+
+// Compiled out, but the arguments still count as used
+#define LOG(...) do { if (0) fprintf(stderr, __VA_ARGS__); } while (0)
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define BLOCK_LEN 1024
 
 #define ARR_EXPAND(arr) do {                                                   \
     if (((arr)->len + 1) > (arr)->cap) {                                       \
@@ -58,695 +73,6693 @@ typedef struct {
     int64_t len;
 } Str;
 
-Str stralloc(const char *str) {
-    int len = strlen(str);
-    uint8_t *tmp = malloc(len + 1);
-    strncpy((char *)tmp, str, len + 1);
-    return (Str){.data = tmp, .len = len};
-}
+typedef enum {
+    SOURCE_MMAP,
+    SOURCE_PAGED,
+} SourceKind;
+
+typedef struct {
+    uint64_t index;
+    uint64_t len;
+    uint64_t last_used;
+    uint8_t *data;
+} CachedPage;
+
+typedef struct {
+    CachedPage *pages;
+    uint64_t count;
+    uint64_t cap;
+    uint64_t tick;
+    CachedPage *last_hit;
+} PageCache;
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} Range;
+
+typedef struct {
+    Range *data;
+    uint64_t len;
+    uint64_t cap;
+} RangeArr;
 
 typedef struct {
     char *name;
+    int fd;
+    SourceKind kind;
+    uint64_t size;  // only grows, while following, workers read it through file_size()
+
+    // SOURCE_MMAP maps the whole file, SOURCE_PAGED reads it through the cache a page at a time
     uint8_t *data;
-    uint64_t size;
+    PageCache cache;
+
+    bool regular;
+    bool writable;
+    bool detached;
+
+    // What in-place saves wrote over, sorted and apart. Mapped pieces there still read the pinned old bytes, the disk doesn't
+    RangeArr overwritten;
 } File;
 
 typedef struct {
-    uint8_t *data;
+    union {
+        uint8_t *data;   // patch pieces point into the add buffer, fills at their tile
+        uint64_t start;  // the rest are a range of the source file
+    };
     uint64_t len;
 
     bool patch;
+
+    // Fills are patches whose bytes repeat every fill_period, starting fill_phase bytes into the tile
+    bool fill;
+    uint16_t fill_period;
+    uint16_t fill_phase;
 } Block;
 
+typedef struct AddArena {
+    struct AddArena *prev;
+    uint64_t len;
+    uint64_t cap;
+    uint8_t data[];
+} AddArena;
+
 typedef struct {
-    Block *data;
+    AddArena *tail;
+    uint64_t used;
+    uint64_t allocated;
+} AddBuffer;
+
+typedef struct PieceNode {
+    struct PieceNode *left;
+    struct PieceNode *right;
+
+    Block block;
+    uint64_t size;
+    uint64_t count;
+    int height;
+
+    uint64_t gen;
+
+    // CRC32C of the subtree, filled in lazily and only good while crc_epoch matches
+    uint32_t crc;
+    uint32_t crc_epoch;
+} PieceNode;
+
+typedef struct {
+    PieceNode *root;
+} PieceTree;
+
+// AVL trees stay under 1.45 * log2(n) tall, 96 covers any 64-bit piece count
+#define PIECE_MAX_DEPTH 96
+typedef struct {
+    PieceNode *stack[PIECE_MAX_DEPTH];
+    int depth;
+    uint64_t offset;
+} PieceIter;
+
+typedef struct {
+    PieceNode *root;
+    uint64_t cursor;
+    uint64_t source_size;  // how much of a followed file this version has taken in
+} Version;
+
+typedef struct {
+    Version *data;
     uint64_t len;
     uint64_t cap;
-} BlockArr;
+} VersionArr;
 
 typedef struct {
     uint64_t rows;
     uint64_t cols;
 } Window;
 
+typedef struct {
+    double entropy;  // bits per byte
+    char kind;       // 'Z'ero, 'A'scii, 'H'igh entropy, other 'B'inary, '?' not scanned yet
+    bool visible;    // overlaps the bytes on screen
+} MinimapCell;
+
+typedef enum {
+    HASH_NONE,
+    HASH_CRC32C,
+    HASH_SHA256,
+    HASH_XXH64,
+} HashKind;
+
 typedef struct {
     File file;
     Window w;
-    int x;
-    int y;
     bool updated;
 
-    uint8_t *buffer; 
-    uint64_t buffer_len;
-    uint64_t offset;
+    PieceTree blocks;
+    AddBuffer add;
+    VersionArr history;
+    uint64_t version;
+
+    // Pieces last yanked or cut, sharing nodes with the document instead of holding bytes
+    PieceTree clipboard;
 
-    BlockArr blocks;
+    uint64_t compact_edits;
+    uint64_t compact_offset;
+
+    // Bumped whenever the document's bytes change, compaction swaps the tree without touching it
+    uint64_t edit_count;
+
+    uint8_t search[256];
+    uint64_t search_len;
+
+    char status[64];
+    bool show_stats;
+    bool show_minimap;
+
+    // The digest shown in the header, hash_end is UINT64_MAX when it runs to the end of the document
+    HashKind hash;
+    uint64_t hash_start;
+    uint64_t hash_end;
 } ViewState;
 
 bool is_printable(char c) {
     return (c >= 32 && c <= 126);
 }
 
-char term_buf[32] = {};
+/*
+ * Stats
+ *
+ * Running counters for where the time and memory go. 's' shows them on the
+ * bottom row, and --stats prints them as JSON to stderr on exit.
+ */
+
+typedef struct {
+    uint64_t frames;
+    uint64_t frame_ns;
+    uint64_t frame_ns_max;
+
+    uint64_t term_writes;
+    uint64_t term_bytes;
+    uint64_t disk_writes;
+    uint64_t disk_bytes;
+    _Atomic uint64_t preads;  // search workers read pages too
+    _Atomic uint64_t pread_bytes;
+
+    uint64_t nodes;   // piece nodes ever allocated, old versions keep most of them alive
+    uint64_t copied;  // bytes get_data has memcpy'd
+
+    // What the last frame cost on its own
+    uint64_t last_frame_ns;
+    uint64_t last_frame_writes;
+    uint64_t last_frame_bytes;
+    uint64_t last_frame_preads;
+    uint64_t last_frame_copied;
+} Stats;
+
+Stats stats = {};
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Terminal output
+ *
+ * Everything for a frame gets appended to one output buffer and handed to
+ * the terminal with a single write. The rows of the last frame are kept
+ * around, so only rows whose text actually changed get re-sent.
+ */
+
+typedef struct {
+    char *data;
+    uint64_t len;
+    uint64_t cap;
+} OutBuf;
+
+OutBuf out = {};
+
+void out_reserve(uint64_t len) {
+    if (out.len + len > out.cap) {
+        out.cap = MAX(out.cap * 2, out.len + len);
+        out.cap = MAX(out.cap, 4096);
+        out.data = realloc(out.data, out.cap);
+    }
+}
+
+void out_append(const char *str, uint64_t len) {
+    out_reserve(len);
+    memcpy(out.data + out.len, str, len);
+    out.len += len;
+}
+
+void out_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    out_reserve(len + 1);
+    va_start(args, fmt);
+    vsnprintf(out.data + out.len, len + 1, fmt, args);
+    va_end(args);
+    out.len += len;
+}
+
+void flush_out(void) {
+    uint64_t written = 0;
+    while (written < out.len) {
+        ssize_t ret = write(1, out.data + written, out.len - written);
+        stats.term_writes++;
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        written += ret;
+        stats.term_bytes += ret;
+    }
+    out.len = 0;
+}
+
+void set_autowrap(bool on) {
+    out_printf(on ? "\x1b[?7h" : "\x1b[?7l");
+}
 void enable_altbuffer(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[?1049h");
-    write(0, term_buf, len);
+    out_printf("\x1b[?1049h");
 }
 void disable_altbuffer(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[?1049l");
-    write(0, term_buf, len);
+    out_printf("\x1b[?1049l");
 }
 void save_term(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[?47h");
-    write(0, term_buf, len);
+    out_printf("\x1b[?47h");
 }
 void restore_term(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[?47l");
-    write(0, term_buf, len);
+    out_printf("\x1b[?47l");
 }
 void clear_term(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[2J");
-    write(0, term_buf, len);
+    out_printf("\x1b[2J");
 }
 void reset_cursor(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[H");
-    write(0, term_buf, len);
+    out_printf("\x1b[H");
 }
 void set_cursor(int row, int col) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[%d;%dH", col, row);
-    write(0, term_buf, len);
+    out_printf("\x1b[%d;%dH", col, row);
 }
 void erase_line(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[2K");
-    write(0, term_buf, len);
+    out_printf("\x1b[2K");
 }
 void set_foreground(int color) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[38;5;%dm", color);
-    write(0, term_buf, len);
+    out_printf("\x1b[38;5;%dm", color);
 }
 void set_background(int color) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[48;5;%dm", color);
-    write(0, term_buf, len);
+    out_printf("\x1b[48;5;%dm", color);
 }
 void reset_color(void) {
-    int len = snprintf(term_buf, sizeof(term_buf), "\x1b[0m");
-    write(0, term_buf, len);
+    out_printf("\x1b[0m");
+}
+void set_scroll_region(int top, int bottom) {
+    out_printf("\x1b[%d;%dr", top, bottom);
+}
+void set_mouse_reporting(bool on) {
+    out_printf(on ? "\x1b[?1000h\x1b[?1006h" : "\x1b[?1000l\x1b[?1006l");
+}
+void reset_scroll_region(void) {
+    out_printf("\x1b[r");
+}
+void scroll_up(int lines) {
+    out_printf("\x1b[%dS", lines);
+}
+void scroll_down(int lines) {
+    out_printf("\x1b[%dT", lines);
 }
 
-void print_view(uint8_t *buffer, uint64_t buffer_size, uint64_t total_size, uint64_t offset) {
-    if (((int64_t)total_size - (int64_t)offset) <= 0) {
-        printf("no bytes to display!\n");
+#define ROW_MAX_LEN 1024
+
+typedef struct {
+    char *rows;
+    int *row_lens;
+    uint64_t row_count;
+
+    uint64_t offset;
+
+    // Where row 0 sits on the terminal, 1-based, and how many columns it owns (0 for whole lines)
+    int top;
+    int left;
+    int width;
+} ScreenCache;
+
+// Forgets what's on screen, every row gets drawn on the next frame
+void screen_invalidate(ScreenCache *s) {
+    for (uint64_t i = 0; i < s->row_count; i++) {
+        s->row_lens[i] = -1;
+    }
+}
+
+void screen_resize(ScreenCache *s, uint64_t row_count) {
+    if (s->row_count == row_count) {
         return;
     }
 
-    uint64_t rem_file_size = total_size - offset;
-    uint64_t read_size = buffer_size;
-    if (rem_file_size < buffer_size) {
-        read_size = rem_file_size % buffer_size;
+    s->row_count = row_count;
+    s->rows = realloc(s->rows, row_count * ROW_MAX_LEN);
+    s->row_lens = realloc(s->row_lens, row_count * sizeof(int));
+    screen_invalidate(s);
+}
+
+void emit_row(ScreenCache *s, uint64_t row, const char *str, int len) {
+    if (row >= s->row_count) {
+        return;
     }
 
-    uint64_t chunk_size = 16;
-    for (int i = 0; i < (buffer_size / chunk_size); i++) {
-        uint64_t sub_idx = i * chunk_size;
+    len = MIN(len, ROW_MAX_LEN);
+    char *cached = s->rows + (row * ROW_MAX_LEN);
+    if (s->row_lens[row] == len && !memcmp(cached, str, len)) {
+        return;
+    }
 
-        uint8_t *row = (uint8_t *)buffer + sub_idx;
-        if (sub_idx >= read_size) {
-            break;
-        }
+    // A pane next to another can only blank its own columns
+    set_cursor(s->left, s->top + row);
+    if (s->width) {
+        out_printf("\x1b[%dX", s->width);
+    } else {
+        erase_line();
+    }
+    out_append(str, len);
 
-        printf("\x1b[38;5;248m%08llx\x1b[0m: ", offset + sub_idx);
+    memcpy(cached, str, len);
+    s->row_lens[row] = len;
+}
 
-        for (int j = 0; j < chunk_size; j++) {
-            if (sub_idx + j >= read_size) {
-                printf("   ");
-                continue;
-            }
-            uint64_t byte_idx = offset + sub_idx + j;
+// Moves whole lines with the terminal's scroll region, so only the exposed rows need drawing
+void scroll_rows(ScreenCache *s, int64_t lines) {
+    uint64_t dist = lines < 0 ? -lines : lines;
+    if (!lines || dist >= s->row_count || s->width) {
+        return;
+    }
 
-            uint8_t ch = row[j];
-            printf("%02x ", ch);
-        }
-        printf(" \x1b[38;5;248m");
-        for (int j = 0; j < chunk_size; j++) {
-            if (sub_idx + j >= read_size) {
-                printf("   ");
-                continue;
-            }
-            uint64_t byte_idx = offset + sub_idx + j;
+    uint64_t kept = s->row_count - dist;
+    set_scroll_region(s->top, s->top + s->row_count - 1);
+    if (lines > 0) {
+        scroll_up(dist);
+        memmove(s->rows, s->rows + (dist * ROW_MAX_LEN), kept * ROW_MAX_LEN);
+        memmove(s->row_lens, s->row_lens + dist, kept * sizeof(int));
+        for (uint64_t i = kept; i < s->row_count; i++) s->row_lens[i] = 0;
+    } else {
+        scroll_down(dist);
+        memmove(s->rows + (dist * ROW_MAX_LEN), s->rows, kept * ROW_MAX_LEN);
+        memmove(s->row_lens + dist, s->row_lens, kept * sizeof(int));
+        for (uint64_t i = 0; i < dist; i++) s->row_lens[i] = 0;
+    }
+}
 
-            char ch = row[j];
+ScreenCache header_screen = {.top = 1, .left = 1};
 
-            if (!is_printable(ch)) {
-                ch = '.';
-            }
+// One window onto the document. Panes share everything but where they look and what they last drew
+typedef struct {
+    uint64_t offset;
+    int x;
+    int y;
 
-            printf("%c", ch);
-        }
-        printf("\x1b[0m\n");
+    // Bytes as of the last draw, refetched when the pane scrolls or an edit lands in them
+    uint8_t *buffer;
+    uint64_t buffer_len;
+    bool stale;
 
-        if (i >= read_size / chunk_size) {
-            break;
-        }
-    }
+    ScreenCache screen;
+    uint64_t rows;
+    uint64_t cols;
 
-    return;
+    // Document range last handed to the kernel for readahead
+    uint64_t prefetch_start;
+    uint64_t prefetch_end;
+} Pane;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * Row formatting kernels
+ *
+ * A full 16 byte row turns into 48 chars of "xx " pairs plus 16 chars of
+ * ascii. The vector paths look nibbles up with a byte shuffle and pick
+ * printable chars with a compare mask; partial rows use the scalar path.
+ */
+
+static void format_hex_scalar(char *hex, char *ascii, uint8_t *row) {
+    for (int j = 0; j < 16; j++) {
+        hex[(j * 3) + 0] = hex_digits[row[j] >> 4];
+        hex[(j * 3) + 1] = hex_digits[row[j] & 0xF];
+        hex[(j * 3) + 2] = ' ';
+        ascii[j] = is_printable(row[j]) ? row[j] : '.';
+    }
 }
 
-bool has_overlap(uint64_t a_start, uint64_t a_end, uint64_t b_start, uint64_t b_end) {
-    return a_end >= b_start && a_start <= b_end;
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+
+__attribute__((target("ssse3")))
+static void format_hex_ssse3(char *hex, char *ascii, uint8_t *row) {
+    const __m128i lut  = _mm_loadu_si128((const __m128i *)hex_digits);
+    const __m128i low  = _mm_set1_epi8(0x0F);
+
+    __m128i bytes = _mm_loadu_si128((const __m128i *)row);
+    __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(bytes, 4), low));
+    __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(bytes, low));
+
+    // Spread the hi/lo digits out to "xx " triples, 0x80 lanes shuffle in a zero
+    const int8_t z = (int8_t)0x80;
+    const __m128i hi_0 = _mm_setr_epi8(0, z, z, 1, z, z, 2, z, z, 3, z, z, 4, z, z, 5);
+    const __m128i lo_0 = _mm_setr_epi8(z, 0, z, z, 1, z, z, 2, z, z, 3, z, z, 4, z, z);
+    const __m128i sp_0 = _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0);
+    const __m128i hi_1 = _mm_setr_epi8(z, z, 6, z, z, 7, z, z, 8, z, z, 9, z, z, 10, z);
+    const __m128i lo_1 = _mm_setr_epi8(5, z, z, 6, z, z, 7, z, z, 8, z, z, 9, z, z, 10);
+    const __m128i sp_1 = _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0);
+    const __m128i hi_2 = _mm_setr_epi8(z, 11, z, z, 12, z, z, 13, z, z, 14, z, z, 15, z, z);
+    const __m128i lo_2 = _mm_setr_epi8(z, z, 11, z, z, 12, z, z, 13, z, z, 14, z, z, 15, z);
+    const __m128i sp_2 = _mm_setr_epi8(' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ');
+
+    __m128i out_0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(hi, hi_0), _mm_shuffle_epi8(lo, lo_0)), sp_0);
+    __m128i out_1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(hi, hi_1), _mm_shuffle_epi8(lo, lo_1)), sp_1);
+    __m128i out_2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(hi, hi_2), _mm_shuffle_epi8(lo, lo_2)), sp_2);
+    _mm_storeu_si128((__m128i *)(hex + 0),  out_0);
+    _mm_storeu_si128((__m128i *)(hex + 16), out_1);
+    _mm_storeu_si128((__m128i *)(hex + 32), out_2);
+
+    // Signed compares, so anything >= 0x80 falls out of the printable range too
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(31)), _mm_cmplt_epi8(bytes, _mm_set1_epi8(127)));
+    __m128i chars = _mm_or_si128(_mm_and_si128(printable, bytes), _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+    _mm_storeu_si128((__m128i *)ascii, chars);
 }
 
-Block new_block(uint8_t *data, uint64_t len, bool patch) {
-    return (Block){.data = data, .len = len, .patch = patch};
-}
+typedef void (*FormatHexFn)(char *hex, char *ascii, uint8_t *row);
+static FormatHexFn format_hex_full = NULL;
 
-Block new_block_from_str(const char *str) {
-    Str s = stralloc(str);
-    return (Block){.data = s.data, .len = s.len, .patch = false};
+static void format_hex(char *hex, char *ascii, uint8_t *row) {
+    if (!format_hex_full) {
+        __builtin_cpu_init();
+        format_hex_full = __builtin_cpu_supports("ssse3") ? format_hex_ssse3 : format_hex_scalar;
+    }
+    format_hex_full(hex, ascii, row);
 }
 
-void print_block(Block *b) {
-    LOG("Block %p %llu %s\n", b->data, b->len, b->patch ? "(patched)" : "");
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+static void format_hex(char *hex, char *ascii, uint8_t *row) {
+    const uint8x16_t lut = vld1q_u8((const uint8_t *)hex_digits);
+
+    uint8x16_t bytes = vld1q_u8(row);
+    uint8x16x3_t triples = {{
+        vqtbl1q_u8(lut, vshrq_n_u8(bytes, 4)),
+        vqtbl1q_u8(lut, vandq_u8(bytes, vdupq_n_u8(0x0F))),
+        vdupq_n_u8(' '),
+    }};
+    vst3q_u8((uint8_t *)hex, triples);
+
+    uint8x16_t printable = vandq_u8(vcgtq_u8(bytes, vdupq_n_u8(31)), vcltq_u8(bytes, vdupq_n_u8(127)));
+    vst1q_u8((uint8_t *)ascii, vbslq_u8(printable, bytes, vdupq_n_u8('.')));
 }
-void print_block_w_offset(Block *b, uint64_t offset) {
-    LOG("Block %p %llx -> %llx %s\n", b->data, offset, offset + b->len, b->patch ? "(patched)" : "");
+
+#else
+
+static void format_hex(char *hex, char *ascii, uint8_t *row) {
+    format_hex_scalar(hex, ascii, row);
 }
 
-void print_blocks(BlockArr *blocks) {
-    uint64_t accum_offset = 0;
-    for (int i = 0; i < blocks->len; i++) {
-        Block *b = &blocks->data[i];
-        LOG("Block %p | off: %llu len: %llu %s\n", b->data, accum_offset, b->len, b->patch ? "(patched)" : "");
-        accum_offset += b->len;
+#endif
+
+static int format_offset(char *dst, uint64_t offset) {
+    int digits = 8;
+    while (digits < 16 && (offset >> (digits * 4))) {
+        digits++;
     }
-}
 
-uint64_t get_total_size(ViewState *view) {
-    uint64_t accum_offset = 0;
-    for (int i = 0; i < view->blocks.len; i++) {
-        accum_offset += view->blocks.data[i].len;
+    for (int i = digits - 1; i >= 0; i--) {
+        dst[i] = hex_digits[offset & 0xF];
+        offset >>= 4;
     }
-    return accum_offset;
+    return digits;
 }
 
-void generate_patchblock(ViewState *view, int block_idx, uint64_t inner_offset) {
-    Block *b = &view->blocks.data[block_idx];
+#define APPEND_LIT(dst, len, lit) do { memcpy((dst) + (len), (lit), sizeof(lit) - 1); (len) += sizeof(lit) - 1; } while (0)
 
-    uint64_t rounded_offset = inner_offset - (inner_offset % BLOCK_LEN);
-    uint64_t prev_b_len = BLOCK_LEN * (inner_offset / BLOCK_LEN);
-    uint64_t seg_len = b->len - rounded_offset;
+// Wraps [start, end) of the len chars at dst in the selection colour, returning the new length
+static int highlight_span(char *dst, int len, int start, int end) {
+    static const char on[] = "\x1b[48;5;24m";
+    static const char off[] = "\x1b[49m";
+    int on_len = sizeof(on) - 1;
+    int off_len = sizeof(off) - 1;
 
-    uint64_t block_len = MIN(seg_len, BLOCK_LEN);
+    memmove(dst + end + on_len + off_len, dst + end, len - end);
+    memmove(dst + start + on_len, dst + start, end - start);
+    memcpy(dst + start, on, on_len);
+    memcpy(dst + end + on_len, off, off_len);
+    return len + on_len + off_len;
+}
 
-    uint8_t *bbuffer = malloc(block_len);
-    memcpy(bbuffer, b->data + rounded_offset, block_len);
-    Block patch_block = new_block(bbuffer, block_len, true);
+// Bytes [sel_lo, sel_hi) of the row are drawn as selected
+int format_row(char *dst, uint8_t *row, uint64_t row_len, uint64_t offset, uint64_t sel_lo, uint64_t sel_hi) {
+    sel_hi = MIN(sel_hi, row_len);
+    bool selected = sel_lo < sel_hi;
 
-    LOG("generating patchblock\n");
-    LOG("inner: %llu, rounded: %llu | seg_len: %llu, block_len: %llu\n", inner_offset, rounded_offset, seg_len, block_len);
-    print_block_w_offset(&patch_block, rounded_offset);
+    int len = 0;
+    APPEND_LIT(dst, len, "\x1b[38;5;248m");
+    len += format_offset(dst + len, offset);
+    APPEND_LIT(dst, len, "\x1b[0m: ");
 
-    if (b->len < BLOCK_LEN) {
-        LOG("Converting the whole block to a patch block\n");
-        *b = patch_block;
-        return;
+    char *hex = dst + len;
+    char ascii[16];
+    if (row_len == 16) {
+        format_hex(hex, ascii, row);
+    } else {
+        uint8_t padded[16] = {};
+        memcpy(padded, row, row_len);
+        format_hex_scalar(hex, ascii, padded);
+        memset(hex + (row_len * 3), ' ', (16 - row_len) * 3);
     }
+    len += selected ? highlight_span(hex, 48, sel_lo * 3, sel_hi * 3 - 1) : 48;
 
-    // Do a head-insert
-    if (rounded_offset == 0) {
-        LOG("head patch\n");
-        LOG("pre-patch blocks\n");
-        print_blocks(&view->blocks);
+    APPEND_LIT(dst, len, " \x1b[38;5;248m");
+    memcpy(dst + len, ascii, row_len);
+    len += selected ? highlight_span(dst + len, row_len, sel_lo, sel_hi) : (int)row_len;
 
-        Block old_b = *b;
-        *b = patch_block;
-        Block next_b = new_block(old_b.data + patch_block.len, old_b.len - patch_block.len, false);
-        ARR_INSERT(&view->blocks, next_b, block_idx+1);
-
-        LOG("post-patch blocks\n");
-        print_blocks(&view->blocks);
-
-        return;
-    } else {
-        LOG("middle patch\n");
-        //print_blocks(&view->blocks);
-
-        Block old_b = *b;
-        Block prev_b = new_block(old_b.data, prev_b_len, false);
-        Block next_b = new_block(old_b.data + rounded_offset + patch_block.len, old_b.len - prev_b.len - patch_block.len, false);
+    APPEND_LIT(dst, len, "\x1b[0m");
+    return len;
+}
 
-        LOG("block to split, splitting at %llu\n", rounded_offset);
-        print_block(&old_b);
+// Jumps to column col and draws one minimap cell: a marker if it's on screen, the entropy digit and the class
+int format_minimap_cell(char *dst, MinimapCell *cell, int col) {
+    int color = 238;
+    switch (cell->kind) {
+        case 'A': color = 28; break;
+        case 'H': color = 124; break;
+        case 'B': color = 25; break;
+    }
 
-        LOG("pieces\n");
-        print_block(&prev_b);
-        print_block(&patch_block);
-        print_block(&next_b);
+    char digit = cell->kind == '?' ? ' ' : '0' + (int)MIN(cell->entropy, 8);
+    return sprintf(dst, "\x1b[%dG%c\x1b[48;5;%dm\x1b[38;5;255m%c%c\x1b[0m",
+                   col, cell->visible ? '>' : ' ', color, digit, cell->kind);
+}
 
-        *b = prev_b;
-        ARR_INSERT(&view->blocks, patch_block, block_idx+1);
-        ARR_INSERT(&view->blocks, next_b,      block_idx+2);
+// One side of a diff row, with the bytes that don't match the other side highlighted
+static int format_diff_half(char *dst, uint8_t *row, uint64_t row_len, uint8_t *other, uint64_t other_len, bool ascii) {
+    int len = 0;
+    bool lit = false;
+    for (uint64_t i = 0; i < 16; i++) {
+        bool differs = i < row_len && (i >= other_len || row[i] != other[i]);
+        if (differs != lit) {
+            len += differs ? sprintf(dst + len, "\x1b[48;5;124m") : sprintf(dst + len, "\x1b[49m");
+            lit = differs;
+        }
 
-        LOG("middle insert done\n");
-        //print_blocks(&view->blocks);
-        return;
+        if (i < row_len) {
+            dst[len++] = hex_digits[row[i] >> 4];
+            dst[len++] = hex_digits[row[i] & 0xF];
+        } else {
+            dst[len++] = ' ';
+            dst[len++] = ' ';
+        }
+        dst[len++] = ' ';
+    }
+    if (lit) {
+        APPEND_LIT(dst, len, "\x1b[49m");
+        lit = false;
     }
-}
 
-void generate_patchruns(ViewState *view, uint64_t offset, uint64_t len) {
-    if (len == 0) {
-        return;
+    if (ascii) {
+        APPEND_LIT(dst, len, "\x1b[38;5;248m");
+        for (uint64_t i = 0; i < 16; i++) {
+            bool differs = i < row_len && (i >= other_len || row[i] != other[i]);
+            if (differs != lit) {
+                len += differs ? sprintf(dst + len, "\x1b[48;5;124m") : sprintf(dst + len, "\x1b[49m");
+                lit = differs;
+            }
+            dst[len++] = i >= row_len ? ' ' : is_printable(row[i]) ? row[i] : '.';
+        }
+        APPEND_LIT(dst, len, "\x1b[0m");
     }
+    return len;
+}
 
-    uint64_t d_head = offset;
-    uint64_t d_tail = offset + len;
+// Both files side by side, ascii columns only if the terminal is wide enough for them
+int format_diff_row(char *dst, uint8_t *a, uint64_t a_len, uint8_t *b, uint64_t b_len, uint64_t offset, bool ascii) {
+    int len = 0;
+    APPEND_LIT(dst, len, "\x1b[38;5;248m");
+    len += format_offset(dst + len, offset);
+    APPEND_LIT(dst, len, "\x1b[0m: ");
+
+    len += format_diff_half(dst + len, a, a_len, b, b_len, ascii);
+    APPEND_LIT(dst, len, "\x1b[38;5;248m| \x1b[0m");
+    len += format_diff_half(dst + len, b, b_len, a, a_len, ascii);
+    return len;
+}
 
-    uint64_t accum_offset = 0;
-    for (int i = 0; i < view->blocks.len; i++) {
-        Block *b = &view->blocks.data[i];
+void print_diff_view(ScreenCache *s, uint8_t *a, uint64_t a_size, uint8_t *b, uint64_t b_size, uint64_t row_count, uint64_t offset, bool ascii) {
+    char line[ROW_MAX_LEN];
+    for (uint64_t i = 0; i < row_count; i++) {
+        uint64_t sub_idx = i * 16;
+        uint64_t a_len = a_size > sub_idx ? MIN(a_size - sub_idx, 16) : 0;
+        uint64_t b_len = b_size > sub_idx ? MIN(b_size - sub_idx, 16) : 0;
 
-        // skip over tombstones
-        if (b->len == 0) {
-            continue;
+        int len = 0;
+        if (a_len || b_len) {
+            len = format_diff_row(line, a + sub_idx, a_len, b + sub_idx, b_len, offset + sub_idx, ascii);
         }
+        emit_row(s, i, line, len);
+    }
+}
 
-        uint64_t b_head = accum_offset;
-        uint64_t b_tail = accum_offset + b->len;
+// [sel_start, sel_end) is the selection, empty when there's none
+void print_view(ScreenCache *s, uint8_t *buffer, uint64_t buffer_size, uint64_t total_size, uint64_t offset,
+                uint64_t sel_start, uint64_t sel_end, MinimapCell *cells, int minimap_col) {
+    uint64_t chunk_size = 16;
+    uint64_t row_count = buffer_size / chunk_size;
+    char line[ROW_MAX_LEN];
 
-        accum_offset += b->len;
+    uint64_t read_size = 0;
+    if (total_size > offset) {
+        read_size = MIN(total_size - offset, buffer_size);
+    }
 
-        // Skip any block that ends before our delete
-        if (d_head > b_tail) {
-            continue;
-        }
+    for (uint64_t i = 0; i < row_count; i++) {
+        uint64_t sub_idx = i * chunk_size;
 
-        // exit, we've seen all the blocks we need to edit
-        if (b_head >= d_tail) {
-            break;
+        int len = 0;
+        if (!read_size && i == 0) {
+            len = snprintf(line, sizeof(line), "no bytes to display!");
+        } else if (sub_idx < read_size) {
+            uint64_t row_len = MIN(chunk_size, read_size - sub_idx);
+            uint64_t row_start = offset + sub_idx;
+            uint64_t sel_lo = MAX(sel_start, row_start) - row_start;
+            uint64_t sel_hi = MAX(sel_end, row_start) - row_start;
+            len = format_row(line, buffer + sub_idx, row_len, row_start, sel_lo, sel_hi);
         }
 
-        uint64_t inner_offset = (uint64_t)MAX((int64_t)d_head - (int64_t)b_head, (int64_t)b_head);
-        if (!b->patch) {
-            generate_patchblock(view, i, inner_offset);
+        if (cells) {
+            len += format_minimap_cell(line + len, &cells[i], minimap_col);
         }
+        emit_row(s, i, line, len);
     }
 }
 
-void delete_data(ViewState *view, uint64_t offset, uint64_t len) {
-    if (len == 0) {
-        return;
-    }
+bool has_overlap(uint64_t a_start, uint64_t a_end, uint64_t b_start, uint64_t b_end) {
+    return a_end >= b_start && a_start <= b_end;
+}
 
-    LOG("deleting from %llx -> %llx\n", offset, offset+len);
-    generate_patchruns(view, offset, len);
+Block new_block(uint8_t *data, uint64_t len, bool patch) {
+    return (Block){.data = data, .len = len, .patch = patch};
+}
 
-    uint64_t d_head = offset;
-    uint64_t d_tail = offset + len;
+Block file_block(uint64_t start, uint64_t len) {
+    return (Block){.start = start, .len = len, .patch = false};
+}
 
-    uint64_t accum_deleted = 0;
-    uint64_t accum_offset = 0;
-    for (int i = 0; i < view->blocks.len; i++) {
-        Block *b = &view->blocks.data[i];
+Block block_slice(Block b, uint64_t inner, uint64_t len) {
+    if (b.fill) {
+        b.fill_phase = (b.fill_phase + inner) % b.fill_period;
+    } else if (b.patch) {
+        b.data += inner;
+    } else {
+        b.start += inner;
+    }
+    b.len = len;
+    return b;
+}
 
-        // skip over tombstones
-        if (b->len == 0) {
-            continue;
+/*
+ * Add buffer
+ *
+ * Every byte typed or pasted in gets appended to a chain of big arenas and
+ * never moves or changes again, pieces just point into it. Arenas are
+ * chained rather than grown so those pointers stay valid.
+ */
+
+#define ADD_ARENA_LEN (4 * 1024 * 1024)
+
+Block add_bytes(AddBuffer *add, const uint8_t *data, uint64_t len) {
+    AddArena *arena = add->tail;
+    if (!arena || arena->cap - arena->len < len) {
+        uint64_t cap = MAX(ADD_ARENA_LEN, len);
+        arena = malloc(sizeof(AddArena) + cap);
+        if (!arena) {
+            // Comes back short, so callers that can fail check the length
+            return new_block(NULL, 0, true);
         }
+        arena->prev = add->tail;
+        arena->len = 0;
+        arena->cap = cap;
 
-        uint64_t b_head = accum_offset;
-        uint64_t b_tail = accum_offset + b->len;
+        add->tail = arena;
+        add->allocated += cap;
+    }
 
-        accum_offset += b->len;
+    uint8_t *dst = arena->data + arena->len;
+    memcpy(dst, data, len);
+    arena->len += len;
+    add->used += len;
 
-        // Skip any block that ends before our delete
-        if (d_head > b_tail) {
-            continue;
-        }
+    return new_block(dst, len, true);
+}
 
-        // exit, we've seen all the blocks we need to edit
-        if (b_head >= d_tail) {
-            break;
-        }
+/*
+ * A fill repeats a short pattern over a range of any length without
+ * storing it: its piece points at a tile of the pattern repeated to just
+ * under FILL_TILE_LEN, and reads wrap around in that. All zero fills
+ * share one tile, which is never even written to.
+ */
 
-        uint64_t inner_offset = (uint64_t)MAX((int64_t)d_head - (int64_t)b_head, (int64_t)b_head);
+#define FILL_TILE_LEN (64 * 1024)
+#define FILL_MAX_PERIOD 4096
 
-        // if we completely cover a block, just delete it
-        if (d_head <= b_head && d_tail >= b_tail && b->len <= len) {
-            LOG("deleting full block\n");
-            accum_deleted += b->len;
-            b->len = 0;
+static uint8_t fill_zero_tile[FILL_TILE_LEN];
 
-        // If we overlap a block's start
-        } else if (b_head >= d_head && d_tail <= b_tail) {
-            LOG("deleting block start\n");
-            print_block_w_offset(b, accum_offset);
+// Always a whole number of periods, so wrapping back to the start keeps the pattern going
+static inline uint64_t fill_tile_len(uint64_t period) {
+    return FILL_TILE_LEN - (FILL_TILE_LEN % period);
+}
 
-            uint64_t delete_leftovers = len - accum_deleted;
-            b->data += delete_leftovers;
-            b->len -= delete_leftovers;
-            accum_deleted += delete_leftovers;
+static inline bool fill_is_zero(Block *b) {
+    return b->fill && b->data == fill_zero_tile;
+}
 
-        // If we overlap a block's end
-        } else if (d_head > b_head && d_tail > b_tail && d_head < b_tail) {
-            LOG("deleting block end\n");
+Block fill_block(AddBuffer *add, const uint8_t *pattern, uint64_t period, uint64_t len) {
+    Block b = {.data = fill_zero_tile, .len = len, .patch = true, .fill = true, .fill_period = 1};
 
-            uint64_t delete_coverage = b_tail - d_head;
-            b->len -= delete_coverage;
-            accum_deleted += delete_coverage;
+    uint64_t zeros = 0;
+    while (zeros < period && !pattern[zeros]) {
+        zeros++;
+    }
+    if (zeros == period) {
+        return b;
+    }
 
-        // Middle-deletes
-        } else if (d_head >= b_head && d_tail <= b_tail) {
-            LOG("deleting block middle\n");
-            memmove(b->data + inner_offset, b->data + inner_offset + len, b->len - len);
-            b->len -= len;
-            accum_deleted += len;
-        }
+    // No data means there was no memory for the tile
+    uint64_t tile_len = fill_tile_len(period);
+    uint8_t *tile = malloc(tile_len);
+    if (!tile) {
+        b.data = NULL;
+        return b;
+    }
+    for (uint64_t i = 0; i < tile_len; i += period) {
+        memcpy(tile + i, pattern, period);
+    }
+    b.data = add_bytes(add, tile, tile_len).data;
+    b.fill_period = period;
+    free(tile);
+    return b;
+}
 
-        if (accum_deleted == len) {
-            break;
-        }
+void print_block(Block *b) {
+    LOG("Block %llx %llu %s\n", b->start, b->len, b->patch ? "(patched)" : "");
+}
+void print_block_w_offset(Block *b, uint64_t offset) {
+    LOG("Block %llx %llx -> %llx %s\n", b->start, offset, offset + b->len, b->patch ? "(patched)" : "");
+}
+
+/*
+ * Sources
+ *
+ * Regular files get mapped whole. Anything that can't be (block devices,
+ * files bigger than we can map) is read with pread a page at a time into
+ * a small LRU cache, so browsing a huge device takes constant memory.
+ * Every thread that reads a paged source brings its own cache, which
+ * keeps the cache free of locks.
+ */
+
+#define PAGE_LEN (64 * 1024)
+#define PAGE_CACHE_PAGES 256
+
+void page_cache_init(PageCache *cache, uint64_t cap) {
+    *cache = (PageCache){.pages = calloc(cap, sizeof(CachedPage)), .cap = cap};
+}
+
+void page_cache_free(PageCache *cache) {
+    for (uint64_t i = 0; i < cache->count; i++) {
+        free(cache->pages[i].data);
     }
+    free(cache->pages);
+    *cache = (PageCache){};
 }
 
-void insert_data(ViewState *view, uint64_t offset, Block block) {
-    if (block.len == 0) {
-        return;
+void page_cache_clear(PageCache *cache) {
+    for (uint64_t i = 0; i < cache->count; i++) {
+        cache->pages[i].index = UINT64_MAX;
     }
+    cache->last_hit = NULL;
+}
 
-    Block *new_b   = &block;
-    Block *start_b = &view->blocks.data[0];
-    Block *end_b   = &view->blocks.data[view->blocks.len-1];
+static inline uint64_t file_size(File *file) {
+    return __atomic_load_n(&file->size, __ATOMIC_ACQUIRE);
+}
 
-    uint64_t accum_offset = get_total_size(view);
+// The first overwritten range ending after offset
+static uint64_t overwritten_lower_bound(File *file, uint64_t offset) {
+    uint64_t lo = 0;
+    uint64_t hi = file->overwritten.len;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (file->overwritten.data[mid].end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    uint64_t new_b_head   = offset;
-    uint64_t new_b_tail   = offset + new_b->len;
+// Whether the disk still has what [start, start + len) of the source held when it was opened
+bool file_overwritten(File *file, uint64_t start, uint64_t len) {
+    uint64_t i = overwritten_lower_bound(file, start);
+    return i < file->overwritten.len && file->overwritten.data[i].start < start + len;
+}
 
-    uint64_t start_b_head = 0;
-    uint64_t start_b_tail = start_b->len;
+void file_mark_overwritten(File *file, uint64_t start, uint64_t end) {
+    // Every range this one touches folds into it
+    uint64_t i = overwritten_lower_bound(file, start ? start - 1 : 0);
+    uint64_t k = i;
+    RangeArr *arr = &file->overwritten;
+    while (k < arr->len && arr->data[k].start <= end) {
+        start = MIN(start, arr->data[k].start);
+        end = MAX(end, arr->data[k].end);
+        k++;
+    }
 
-    uint64_t end_b_head   = accum_offset - end_b->len;
-    uint64_t end_b_tail   = accum_offset;
+    Range merged = {.start = start, .end = end};
+    if (k > i) {
+        arr->data[i] = merged;
+        memmove(&arr->data[i + 1], &arr->data[k], (arr->len - k) * sizeof(Range));
+        arr->len -= k - i - 1;
+    } else {
+        ARR_INSERT(arr, merged, i);
+    }
+}
 
-    // If we need to insert a new block at the end of our data
-    if (new_b_head >= end_b_tail) {
-        ARR_APPEND(&view->blocks, block);
+static CachedPage *page_cache_get(File *file, PageCache *cache, uint64_t index) {
+    cache->tick++;
+    if (cache->last_hit && cache->last_hit->index == index) {
+        cache->last_hit->last_used = cache->tick;
+        return cache->last_hit;
+    }
 
-        return;
+    CachedPage *victim = NULL;
+    for (uint64_t i = 0; i < cache->count; i++) {
+        CachedPage *page = &cache->pages[i];
+        if (page->index == index) {
+            page->last_used = cache->tick;
+            cache->last_hit = page;
+            return page;
+        }
+        if (!victim || page->last_used < victim->last_used) {
+            victim = page;
+        }
+    }
 
-    // If we just need to push the existing block forward a bit
-    } else if (new_b_head <= start_b_head) {
-        Block post_block = *start_b;
-        *start_b = block;
+    if (cache->count < cache->cap) {
+        victim = &cache->pages[cache->count++];
+        victim->data = malloc(PAGE_LEN);
+    }
 
-        ARR_INSERT(&view->blocks, post_block, 1);
+    uint64_t offset = index * PAGE_LEN;
+    uint64_t want = MIN(PAGE_LEN, file_size(file) - offset);
+    uint64_t got = 0;
+    while (got < want) {
+        ssize_t ret = pread(file->fd, victim->data + got, want - got, offset + got);
+        atomic_fetch_add(&stats.preads, 1);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) break;
+        got += ret;
+        atomic_fetch_add(&stats.pread_bytes, ret);
+    }
 
-        uint64_t new_total_len = block.len + post_block.len;
-        if (new_total_len - post_block.len != new_b->len) {
-            printf("invalid insert!\n");
-            exit(1);
-        }
+    victim->index = got ? index : UINT64_MAX;
+    victim->len = got;
+    victim->last_used = cache->tick;
+    cache->last_hit = got ? victim : NULL;
+    return got ? victim : NULL;
+}
 
-        return;
+// Returns the bytes at offset, and how many can be read from there in one go (0 on a read error)
+uint8_t *file_bytes(File *file, PageCache *cache, uint64_t offset, uint64_t *avail) {
+    uint64_t size = file_size(file);
+    if (offset >= size) {
+        *avail = 0;
+        return NULL;
+    }
 
-    // If we need to do a before/after block split
-    } else {
-        uint64_t accum_offset = 0;
-        for (int i = 0; i < view->blocks.len; i++) {
-            Block *b = &view->blocks.data[i];
+    if (file->kind == SOURCE_MMAP) {
+        *avail = size - offset;
+        return file->data + offset;
+    }
 
-            uint64_t b_head  = accum_offset;
-            accum_offset += b->len;
+    CachedPage *page = page_cache_get(file, cache, offset / PAGE_LEN);
+    uint64_t inner = offset % PAGE_LEN;
+    if (!page || page->len <= inner) {
+        *avail = 0;
+        return NULL;
+    }
 
-            // Skip any block that ends before our block
-            if (new_b_head > accum_offset) {
-                continue;
-            }
+    *avail = page->len - inner;
+    return page->data + inner;
+}
 
-            Block pre_block  = new_block(
-                b->data,
-                new_b_head - b_head,
-                b->patch
-            );
-            Block mid_block  = *new_b;
-            Block post_block = new_block(
-                b->data + pre_block.len,
-                b->len - pre_block.len,
-                b->patch
-            );
+uint8_t *block_bytes(File *file, PageCache *cache, Block *b, uint64_t inner, uint64_t *avail) {
+    if (b->fill) {
+        uint64_t pos = (b->fill_phase + inner) % b->fill_period;
+        *avail = MIN(b->len - inner, fill_tile_len(b->fill_period) - pos);
+        return b->data + pos;
+    }
+    if (b->patch) {
+        *avail = b->len - inner;
+        return b->data + inner;
+    }
 
-            Block old_b = *b;
-            *b = pre_block;
+    uint8_t *bytes = file_bytes(file, cache, b->start + inner, avail);
+    *avail = MIN(*avail, b->len - inner);
+    return bytes;
+}
 
-            ARR_INSERT(&view->blocks, mid_block, i+1);
-            ARR_INSERT(&view->blocks, post_block, i+2);
+/*
+ * Access hints
+ *
+ * Tells the kernel what's coming so it can read ahead of the viewport and
+ * keep big linear scans (search, hashing, diffing, saving) from pushing
+ * everything else out of memory. Mapped sources use madvise, paged ones
+ * posix_fadvise. A scanned window is marked cold once it's done rather
+ * than dropped with MADV_DONTNEED, since the private mapping may hold
+ * pinned copies of bytes an in-place save has since overwritten.
+ */
+
+typedef enum {
+    ADVISE_WILLNEED,    // about to be looked at, start reading it in
+    ADVISE_SEQUENTIAL,  // about to be read through once, front to back
+    ADVISE_DONE,        // done with a sequential window, reclaim it first
+} Advice;
+
+// Set by --hugepages, asks for transparent huge pages on the source mapping
+bool use_hugepages = false;
+
+void file_advise(File *file, uint64_t offset, uint64_t len, Advice advice) {
+    uint64_t end = MIN(offset + len, file_size(file));
+    if (offset >= end) {
+        return;
+    }
 
-            uint64_t new_total_len = pre_block.len + mid_block.len + post_block.len;
-            if (new_total_len - old_b.len != new_b->len) {
-                printf("invalid insert!\n");
-                exit(1);
-            }
+    if (file->kind == SOURCE_PAGED) {
+        int fadvice = advice == ADVISE_WILLNEED   ? POSIX_FADV_WILLNEED
+                    : advice == ADVISE_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+                                                  : POSIX_FADV_DONTNEED;
+        posix_fadvise(file->fd, offset, end - offset, fadvice);
+        return;
+    }
 
-            return;
-        }
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - (offset % page);
+    uint8_t *addr = file->data + start;
+    len = end - start;
+
+    switch (advice) {
+        case ADVISE_WILLNEED: {
+            madvise(addr, len, MADV_WILLNEED);
+        } break;
+        case ADVISE_SEQUENTIAL: {
+            madvise(addr, len, MADV_SEQUENTIAL);
+        } break;
+        case ADVISE_DONE: {
+            // Back to normal first, so the mapping doesn't stay split into a VMA per window
+            madvise(addr, len, MADV_NORMAL);
+#ifdef MADV_COLD
+            madvise(addr, len, MADV_COLD);
+#endif
+        } break;
     }
 }
 
-bool get_data(ViewState *view, uint64_t offset, uint8_t *buffer, uint64_t len) {
-    uint64_t accum_offset = 0;
-    uint64_t accum_len = 0;
+/*
+ * Piece tree
+ *
+ * The pieces live in an AVL tree ordered by document position. Every node
+ * caches the byte length and piece count of its subtree, so finding the
+ * piece under an offset is a single descent, and the whole tree is edited
+ * with split/join rather than by shuffling an array around.
+ *
+ * Trees are persistent: a node is never changed once an edit is done with
+ * it. Each edit bumps piece_gen, and any node from an older generation gets
+ * copied before it's touched, so an edit only copies the path it walks and
+ * every older root stays a valid snapshot of the document.
+ */
+
+uint64_t piece_gen = 1;
+
+// Nodes are never freed (old versions keep them alive), so they're carved out of big slabs
+#define PIECE_SLAB_LEN 4096
+PieceNode *piece_slab = NULL;
+uint64_t piece_slab_left = 0;
+
+static PieceNode *piece_node_alloc(void) {
+    if (!piece_slab_left) {
+        piece_slab = malloc(sizeof(PieceNode) * PIECE_SLAB_LEN);
+        piece_slab_left = PIECE_SLAB_LEN;
+    }
 
-    for (int i = 0; i < view->blocks.len; i++) {
-        Block *b = &view->blocks.data[i];
+    piece_slab_left--;
+    stats.nodes++;
+    return piece_slab++;
+}
 
-        uint64_t view_start  = offset;
-        uint64_t view_end    = offset + len;
-        uint64_t block_start = accum_offset;
-        uint64_t block_end   = accum_offset + b->len;
-        accum_offset += b->len;
+PieceNode *piece_node_new(Block b) {
+    PieceNode *n = piece_node_alloc();
+    *n = (PieceNode){};
+    n->block = b;
+    n->size = b.len;
+    n->count = 1;
+    n->height = 1;
+    n->gen = piece_gen;
+    return n;
+}
 
-        // If the block is before the view range
-        if (block_end < view_start) {
+// Returns a copy of n that the current edit is free to change
+static PieceNode *piece_own(PieceNode *n) {
+    if (n->gen == piece_gen) {
+        return n;
+    }
+
+    PieceNode *copy = piece_node_alloc();
+    *copy = *n;
+    copy->gen = piece_gen;
+    return copy;
+}
+
+static inline uint64_t piece_size(PieceNode *n)   { return n ? n->size : 0; }
+static inline uint64_t piece_count(PieceNode *n)  { return n ? n->count : 0; }
+static inline int      piece_height(PieceNode *n) { return n ? n->height : 0; }
+
+static void piece_update(PieceNode *n) {
+    n->size   = piece_size(n->left) + n->block.len + piece_size(n->right);
+    n->count  = piece_count(n->left) + 1 + piece_count(n->right);
+    n->height = MAX(piece_height(n->left), piece_height(n->right)) + 1;
+    n->crc_epoch = 0;
+}
+
+static PieceNode *piece_rotate_left(PieceNode *n) {
+    n = piece_own(n);
+    PieceNode *r = piece_own(n->right);
+    n->right = r->left;
+    r->left = n;
+    piece_update(n);
+    piece_update(r);
+    return r;
+}
+
+static PieceNode *piece_rotate_right(PieceNode *n) {
+    n = piece_own(n);
+    PieceNode *l = piece_own(n->left);
+    n->left = l->right;
+    l->right = n;
+    piece_update(n);
+    piece_update(l);
+    return l;
+}
+
+static PieceNode *piece_rebalance(PieceNode *n) {
+    piece_update(n);
+
+    int balance = piece_height(n->left) - piece_height(n->right);
+    if (balance > 1) {
+        if (piece_height(n->left->left) < piece_height(n->left->right)) {
+            n->left = piece_rotate_left(n->left);
+        }
+        return piece_rotate_right(n);
+    } else if (balance < -1) {
+        if (piece_height(n->right->right) < piece_height(n->right->left)) {
+            n->right = piece_rotate_right(n->right);
+        }
+        return piece_rotate_left(n);
+    }
+
+    return n;
+}
+
+// Joins l, mid and r (in that order) into one balanced tree, reusing mid as a node
+PieceNode *piece_join(PieceNode *l, PieceNode *mid, PieceNode *r) {
+    int hl = piece_height(l);
+    int hr = piece_height(r);
+
+    if (hl > hr + 1) {
+        l = piece_own(l);
+        l->right = piece_join(l->right, mid, r);
+        return piece_rebalance(l);
+    }
+    if (hr > hl + 1) {
+        r = piece_own(r);
+        r->left = piece_join(l, mid, r->left);
+        return piece_rebalance(r);
+    }
+
+    mid = piece_own(mid);
+    mid->left = l;
+    mid->right = r;
+    piece_update(mid);
+    return mid;
+}
+
+static PieceNode *piece_pop_last(PieceNode *n, PieceNode **last) {
+    if (!n->right) {
+        *last = n;
+        return n->left;
+    }
+
+    n = piece_own(n);
+    n->right = piece_pop_last(n->right, last);
+    return piece_rebalance(n);
+}
+
+PieceNode *piece_join2(PieceNode *l, PieceNode *r) {
+    if (!l) return r;
+    if (!r) return l;
+
+    PieceNode *last = NULL;
+    l = piece_pop_last(l, &last);
+    return piece_join(l, last, r);
+}
+
+// Splits a tree at a byte offset, cutting a piece in two if the offset lands inside one
+void piece_split(PieceNode *n, uint64_t offset, PieceNode **l, PieceNode **r) {
+    if (!n) {
+        *l = NULL;
+        *r = NULL;
+        return;
+    }
+
+    PieceNode *n_left = n->left;
+    PieceNode *n_right = n->right;
+    uint64_t b_head = piece_size(n_left);
+    uint64_t b_tail = b_head + n->block.len;
+
+    if (offset <= b_head) {
+        PieceNode *sub_l, *sub_r;
+        piece_split(n_left, offset, &sub_l, &sub_r);
+        *l = sub_l;
+        *r = piece_join(sub_r, n, n_right);
+    } else if (offset >= b_tail) {
+        PieceNode *sub_l, *sub_r;
+        piece_split(n_right, offset - b_tail, &sub_l, &sub_r);
+        *l = piece_join(n_left, n, sub_l);
+        *r = sub_r;
+    } else {
+        uint64_t inner_offset = offset - b_head;
+        n = piece_own(n);
+        Block *b = &n->block;
+        PieceNode *tail = piece_node_new(block_slice(*b, inner_offset, b->len - inner_offset));
+        b->len = inner_offset;
+
+        *l = piece_join(n_left, n, NULL);
+        *r = piece_join(NULL, tail, n_right);
+    }
+}
+
+// Builds a balanced tree straight from blocks that are already in document order
+PieceNode *piece_build(Block *blocks, uint64_t count) {
+    if (!count) {
+        return NULL;
+    }
+
+    uint64_t mid = count / 2;
+    PieceNode *n = piece_node_new(blocks[mid]);
+    n->left = piece_build(blocks, mid);
+    n->right = piece_build(blocks + mid + 1, count - mid - 1);
+    piece_update(n);
+    return n;
+}
+
+void piece_iter_seek(PieceIter *it, PieceTree *tree, uint64_t offset) {
+    it->depth = 0;
+    it->offset = 0;
+
+    uint64_t base = 0;
+    PieceNode *n = tree->root;
+    while (n) {
+        uint64_t b_head = base + piece_size(n->left);
+        uint64_t b_tail = b_head + n->block.len;
+
+        if (offset < b_head) {
+            it->stack[it->depth++] = n;
+            n = n->left;
+        } else if (offset < b_tail) {
+            it->stack[it->depth++] = n;
+            it->offset = b_head;
+            return;
+        } else {
+            base = b_tail;
+            n = n->right;
+        }
+    }
+
+    // Nothing lives at or past offset
+    it->depth = 0;
+    it->offset = base;
+}
+
+static inline Block *piece_iter_block(PieceIter *it) {
+    return it->depth ? &it->stack[it->depth - 1]->block : NULL;
+}
+
+void piece_iter_next(PieceIter *it) {
+    if (!it->depth) {
+        return;
+    }
+
+    PieceNode *n = it->stack[--it->depth];
+    it->offset += n->block.len;
+
+    n = n->right;
+    while (n) {
+        it->stack[it->depth++] = n;
+        n = n->left;
+    }
+}
+
+// Starts a walk back from the last piece, which piece_iter_prev continues and piece_iter_next can't
+void piece_iter_seek_last(PieceIter *it, PieceTree *tree) {
+    it->depth = 0;
+    it->offset = piece_size(tree->root);
+    for (PieceNode *n = tree->root; n; n = n->right) {
+        it->stack[it->depth++] = n;
+    }
+    if (it->depth) {
+        it->offset -= piece_iter_block(it)->len;
+    }
+}
+
+void piece_iter_prev(PieceIter *it) {
+    if (!it->depth) {
+        return;
+    }
+
+    PieceNode *n = it->stack[--it->depth];
+    for (n = n->left; n; n = n->right) {
+        it->stack[it->depth++] = n;
+    }
+    if (it->depth) {
+        it->offset -= piece_iter_block(it)->len;
+    }
+}
+
+void print_blocks(PieceTree *blocks) {
+    PieceIter it;
+    for (piece_iter_seek(&it, blocks, 0); piece_iter_block(&it); piece_iter_next(&it)) {
+        Block *b = piece_iter_block(&it);
+        LOG("Block %llx | off: %llu len: %llu %s\n", b->start, it.offset, b->len, b->patch ? "(patched)" : "");
+    }
+}
+
+uint64_t get_total_size(ViewState *view) {
+    return piece_size(view->blocks.root);
+}
+
+// Whether b's bytes carry straight on from a's, so the two can be one piece
+static inline bool pieces_contiguous(Block *a, Block *b) {
+    if (a->fill || b->fill) {
+        return a->fill && b->fill && a->data == b->data && a->fill_period == b->fill_period &&
+               (a->fill_phase + a->len) % a->fill_period == b->fill_phase;
+    }
+    if (a->patch != b->patch) {
+        return false;
+    }
+    return a->patch ? a->data + a->len == b->data : a->start + a->len == b->start;
+}
+
+// Whether a's bytes from inner offset a_at on are b's from b_at on, the same bytes rather than equal ones
+static inline bool pieces_same_bytes(Block *a, uint64_t a_at, Block *b, uint64_t b_at) {
+    if (a->fill || b->fill) {
+        return a->fill && b->fill && a->data == b->data && a->fill_period == b->fill_period &&
+               (a->fill_phase + a_at) % a->fill_period == (b->fill_phase + b_at) % b->fill_period;
+    }
+    if (a->patch != b->patch) {
+        return false;
+    }
+    return a->patch ? a->data + a_at == b->data + b_at : a->start + a_at == b->start + b_at;
+}
+
+// Joins head, block and tail, growing head's last piece instead of adding a node when the bytes line up
+static PieceNode *piece_join_block(PieceNode *head, Block block, PieceNode *tail) {
+    PieceNode *last = head;
+    while (last && last->right) {
+        last = last->right;
+    }
+
+    if (last && pieces_contiguous(&last->block, &block)) {
+        head = piece_pop_last(head, &last);
+        last = piece_own(last);
+        last->block.len += block.len;
+        return piece_join(head, last, tail);
+    }
+
+    return piece_join(head, piece_node_new(block), tail);
+}
+
+// Swaps the piece(s) covering [offset, offset + len) for a single block
+void replace_range(ViewState *view, uint64_t offset, uint64_t len, Block block) {
+    piece_gen++;
+    view->edit_count++;
+
+    PieceNode *head, *mid, *tail;
+    piece_split(view->blocks.root, offset, &head, &tail);
+    piece_split(tail, len, &mid, &tail);
+
+    if (block.len) {
+        view->blocks.root = piece_join_block(head, block, tail);
+    } else {
+        view->blocks.root = piece_join2(head, tail);
+    }
+}
+
+void delete_data(ViewState *view, uint64_t offset, uint64_t len) {
+    uint64_t total_size = get_total_size(view);
+    if (len == 0 || offset >= total_size) {
+        return;
+    }
+    len = MIN(len, total_size - offset);
+
+    LOG("deleting from %llx -> %llx\n", offset, offset+len);
+
+    replace_range(view, offset, len, new_block(NULL, 0, false));
+}
+
+void insert_data(ViewState *view, uint64_t offset, Block block) {
+    if (block.len == 0) {
+        return;
+    }
+
+    uint64_t old_size = get_total_size(view);
+    offset = MIN(offset, old_size);
+
+    piece_gen++;
+    view->edit_count++;
+    PieceNode *head, *tail;
+    piece_split(view->blocks.root, offset, &head, &tail);
+    view->blocks.root = piece_join_block(head, block, tail);
+
+    if (get_total_size(view) - old_size != block.len) {
+        printf("invalid insert!\n");
+        exit(1);
+    }
+}
+
+void overwrite_data(ViewState *view, uint64_t offset, const uint8_t *data, uint64_t len) {
+    uint64_t total_size = get_total_size(view);
+    if (len == 0 || offset >= total_size) {
+        return;
+    }
+    len = MIN(len, total_size - offset);
+
+    Block block = add_bytes(&view->add, data, len);
+    if (block.len == len) {
+        replace_range(view, offset, len, block);
+    }
+}
+
+// Overwrites [offset, offset + len) with pattern repeated, in one piece however long it is
+void fill_data(ViewState *view, uint64_t offset, uint64_t len, const uint8_t *pattern, uint64_t period) {
+    uint64_t total_size = get_total_size(view);
+    if (len == 0 || offset >= total_size) {
+        return;
+    }
+    len = MIN(len, total_size - offset);
+
+    Block block = fill_block(&view->add, pattern, period, len);
+    if (block.data) {
+        replace_range(view, offset, len, block);
+    }
+}
+
+// The pieces of [offset, offset + len) as a tree of their own. Nodes are shared with the document rather than bytes copied
+PieceTree copy_range(ViewState *view, uint64_t offset, uint64_t len) {
+    piece_gen++;
+
+    PieceNode *head, *mid, *tail;
+    piece_split(view->blocks.root, offset, &head, &tail);
+    piece_split(tail, len, &mid, &tail);
+    return (PieceTree){.root = mid};
+}
+
+// Splices pieces in at offset, costing the same however many bytes they cover
+void paste_data(ViewState *view, uint64_t offset, PieceTree *pieces) {
+    if (!pieces->root) {
+        return;
+    }
+    offset = MIN(offset, get_total_size(view));
+
+    piece_gen++;
+    view->edit_count++;
+    PieceNode *head, *tail;
+    piece_split(view->blocks.root, offset, &head, &tail);
+    view->blocks.root = piece_join2(piece_join2(head, pieces->root), tail);
+}
+
+/*
+ * Compaction
+ *
+ * Splits and undone edits leave runs of pieces whose bytes sit right next
+ * to each other in memory. This folds each run back into one piece, a
+ * bounded number of pieces per step, resuming where the last step stopped.
+ * The document doesn't change, so the current version is just swapped for
+ * the compacted tree.
+ */
+
+#define COMPACT_EDIT_THRESHOLD 1024
+#define COMPACT_STEP_PIECES (64 * 1024)
+
+// Returns true once the pass has reached the end of the document
+bool compact_step(ViewState *view, uint64_t budget) {
+    PieceTree old = view->blocks;
+    uint64_t edit_count = view->edit_count;
+
+    // The old tree can't change under us, so walk it while merging into the new one
+    PieceIter it;
+    piece_iter_seek(&it, &old, view->compact_offset);
+    for (uint64_t visited = 0; visited < budget && piece_iter_block(&it); ) {
+        Block run = *piece_iter_block(&it);
+        uint64_t run_start = it.offset;
+        uint64_t run_pieces = 1;
+
+        piece_iter_next(&it);
+        for (Block *b; (b = piece_iter_block(&it)) && pieces_contiguous(&run, b); piece_iter_next(&it)) {
+            run.len += b->len;
+            run_pieces++;
+        }
+        visited += run_pieces;
+
+        if (run_pieces > 1) {
+            replace_range(view, run_start, run.len, run);
+        }
+    }
+
+    bool done = !piece_iter_block(&it);
+    view->compact_offset = done ? 0 : it.offset;
+    if (done) {
+        view->compact_edits = 0;
+    }
+
+    if (view->history.len) {
+        view->history.data[view->version].root = view->blocks.root;
+    }
+
+    // Same bytes, so anything working from the old tree is still right
+    view->edit_count = edit_count;
+    return done;
+}
+
+/*
+ * Undo history
+ *
+ * Every finished edit records its tree root. Since old roots are never
+ * changed, undo and redo just swap which root is current.
+ *
+ * A followed file can grow after a version was made. Each version keeps
+ * how much of the file it has seen, and whatever came in since is added
+ * at its end the next time it becomes current.
+ */
+
+// Whether the document has changed since the current version was recorded
+bool edit_pending(ViewState *view) {
+    return !view->history.len || view->history.data[view->version].root != view->blocks.root;
+}
+
+void commit_edit(ViewState *view, uint64_t cursor) {
+    if (!edit_pending(view)) {
+        return;
+    }
+
+    // A new edit drops whatever could have been redone
+    view->history.len = view->history.len ? view->version + 1 : 0;
+    ARR_APPEND(&view->history, ((Version){.root = view->blocks.root, .cursor = cursor, .source_size = view->file.size}));
+    view->version = view->history.len - 1;
+
+    view->compact_edits++;
+    if (view->compact_edits >= COMPACT_EDIT_THRESHOLD) {
+        compact_step(view, COMPACT_STEP_PIECES);
+    }
+}
+
+// Appends the part of the source the current version hasn't taken in yet
+void version_catch_up(ViewState *view) {
+    Version *version = &view->history.data[view->version];
+    if (version->source_size >= view->file.size) {
+        return;
+    }
+
+    insert_data(view, get_total_size(view), file_block(version->source_size, view->file.size - version->source_size));
+    version->root = view->blocks.root;
+    version->source_size = view->file.size;
+}
+
+bool undo_edit(ViewState *view, uint64_t *cursor) {
+    if (!view->version) {
+        return false;
+    }
+
+    *cursor = view->history.data[view->version].cursor;
+    view->version -= 1;
+    view->blocks.root = view->history.data[view->version].root;
+    view->edit_count++;
+    version_catch_up(view);
+    return true;
+}
+
+bool redo_edit(ViewState *view, uint64_t *cursor) {
+    if (view->version + 1 >= view->history.len) {
+        return false;
+    }
+
+    view->version += 1;
+    view->blocks.root = view->history.data[view->version].root;
+    view->edit_count++;
+    version_catch_up(view);
+    *cursor = view->history.data[view->version].cursor;
+    return true;
+}
+
+bool get_data(ViewState *view, uint64_t offset, uint8_t *buffer, uint64_t len) {
+    uint64_t accum_len = 0;
+
+    PieceIter it;
+    piece_iter_seek(&it, &view->blocks, offset);
+    for (Block *b; accum_len < len && (b = piece_iter_block(&it)); piece_iter_next(&it)) {
+        uint64_t start_offset = (offset + accum_len) - it.offset;
+
+        while (accum_len < len && start_offset < b->len) {
+            uint64_t avail;
+            uint8_t *bytes = block_bytes(&view->file, &view->file.cache, b, start_offset, &avail);
+            if (!avail) {
+                return false;
+            }
+
+            uint64_t bytes_to_grab = MIN(len - accum_len, avail);
+            memcpy(buffer + accum_len, bytes, bytes_to_grab);
+            stats.copied += bytes_to_grab;
+            accum_len += bytes_to_grab;
+            start_offset += bytes_to_grab;
+        }
+    }
+
+    return accum_len == len;
+}
+
+// Passes advice on for the source bytes under [start, end) of a document, merging pieces that sit close together in the file
+void tree_advise(PieceTree *tree, File *file, uint64_t start, uint64_t end, Advice advice) {
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+
+    PieceIter it;
+    piece_iter_seek(&it, tree, start);
+    for (Block *b; it.offset < end && (b = piece_iter_block(&it)); piece_iter_next(&it)) {
+        if (b->patch) {
+            continue;
+        }
+
+        uint64_t lo = b->start + (MAX(start, it.offset) - it.offset);
+        uint64_t hi = b->start + (MIN(end, it.offset + b->len) - it.offset);
+        if (run_end > run_start && lo >= run_start && lo <= run_end + PAGE_LEN) {
+            run_end = MAX(run_end, hi);
+            continue;
+        }
+
+        file_advise(file, run_start, run_end - run_start, advice);
+        run_start = lo;
+        run_end = hi;
+    }
+    file_advise(file, run_start, run_end - run_start, advice);
+}
+
+/*
+ * Batch edits
+ *
+ * A batch is a list of replacements that all refer to offsets in the
+ * document as it was before the batch. Rather than a split and join per
+ * edit, they're sorted, the new piece list is built in one pass over the
+ * old tree, and the tree is rebuilt from that list.
+ */
+
+typedef struct {
+    uint64_t offset;
+    uint64_t len;   // bytes replaced, 0 for a plain insert
+    Block block;    // what goes in their place, empty for a delete
+    uint64_t seq;
+} Edit;
+
+typedef struct {
+    Edit *data;
+    uint64_t len;
+    uint64_t cap;
+} EditArr;
+
+typedef struct {
+    Block *data;
+    uint64_t len;
+    uint64_t cap;
+} BlockArr;
+
+static int edit_cmp(const void *a, const void *b) {
+    const Edit *x = a;
+    const Edit *y = b;
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+
+    // Inserts go before whatever replaces the bytes at the same offset
+    if ((x->len == 0) != (y->len == 0)) {
+        return x->len == 0 ? -1 : 1;
+    }
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static bool batch_push(BlockArr *arr, Block b) {
+    if (!b.len) {
+        return true;
+    }
+
+    if (arr->len && pieces_contiguous(&arr->data[arr->len - 1], &b)) {
+        arr->data[arr->len - 1].len += b.len;
+        return true;
+    }
+
+    // A big batch can want a lot of pieces, running out leaves the document as it was
+    if (arr->len == arr->cap) {
+        uint64_t cap = MAX(arr->cap * 2, 8);
+        Block *data = realloc(arr->data, cap * sizeof(Block));
+        if (!data) {
+            return false;
+        }
+        arr->data = data;
+        arr->cap = cap;
+    }
+    arr->data[arr->len++] = b;
+    return true;
+}
+
+// Appends the pieces covering [start, end) of tree, leaving it on the piece end landed in
+static bool batch_copy(BlockArr *arr, PieceTree *tree, PieceIter *it, uint64_t start, uint64_t end) {
+    Block *b = piece_iter_block(it);
+    if (start < end && (!b || start < it->offset || start >= it->offset + b->len)) {
+        piece_iter_seek(it, tree, start);
+    }
+
+    while (start < end && (b = piece_iter_block(it))) {
+        uint64_t inner = start - it->offset;
+        uint64_t take = MIN(b->len - inner, end - start);
+        if (!batch_push(arr, block_slice(*b, inner, take))) {
+            return false;
+        }
+
+        start += take;
+        if (inner + take == b->len) {
+            piece_iter_next(it);
+        }
+    }
+    return true;
+}
+
+// Applies every edit as one change to the document. Overlapping or out of range edits leave it untouched and
+// come back in *bad, running out of memory leaves it untouched with *bad NULL
+bool apply_batch(ViewState *view, EditArr *edits, Edit **bad) {
+    qsort(edits->data, edits->len, sizeof(Edit), edit_cmp);
+
+    uint64_t total_size = get_total_size(view);
+    uint64_t pos = 0;
+    for (uint64_t i = 0; i < edits->len; i++) {
+        Edit *e = &edits->data[i];
+        if (e->offset < pos || e->offset > total_size || e->len > total_size - e->offset) {
+            *bad = e;
+            return false;
+        }
+        pos = e->offset + e->len;
+    }
+
+    BlockArr blocks = {0};
+    PieceIter it = {0};
+    pos = 0;
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < edits->len; i++) {
+        Edit *e = &edits->data[i];
+        ok = batch_copy(&blocks, &view->blocks, &it, pos, e->offset) && batch_push(&blocks, e->block);
+        pos = e->offset + e->len;
+    }
+    ok = ok && batch_copy(&blocks, &view->blocks, &it, pos, total_size);
+    if (!ok) {
+        *bad = NULL;
+        free(blocks.data);
+        errno = ENOMEM;
+        return false;
+    }
+
+    piece_gen++;
+    view->edit_count++;
+    view->blocks.root = piece_build(blocks.data, blocks.len);
+    free(blocks.data);
+    return true;
+}
+
+/*
+ * Searching
+ *
+ * Patterns are matched straight out of the piece data: each piece (or each
+ * cached page of one, for paged sources) gets a vectorized first/last byte
+ * filter over its own bytes, and the handful of start positions near its
+ * end are checked by walking into the following bytes, so matches across
+ * piece boundaries still show up.
+ */
+
+#define NO_MATCH UINT64_MAX
+
+// Returns the index of the first full match inside data[0..len), or NO_MATCH
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static uint64_t scan_block(uint8_t *data, uint64_t len, uint8_t *pat, uint64_t pat_len) {
+    if (len < pat_len) {
+        return NO_MATCH;
+    }
+
+    uint64_t last = pat_len - 1;
+    uint64_t end = len - last;
+    const __m128i first_b = _mm_set1_epi8(pat[0]);
+    const __m128i last_b  = _mm_set1_epi8(pat[last]);
+
+    uint64_t i = 0;
+    for (; i + 16 <= end; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + last));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first_b), _mm_cmpeq_epi8(tail, last_b)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(data + i + bit + 1, pat + 1, pat_len - 1)) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < end; i++) {
+        if (data[i] == pat[0] && data[i + last] == pat[last] && !memcmp(data + i, pat, pat_len)) {
+            return i;
+        }
+    }
+
+    return NO_MATCH;
+}
+
+#elif defined(__aarch64__)
+
+static uint64_t scan_block(uint8_t *data, uint64_t len, uint8_t *pat, uint64_t pat_len) {
+    if (len < pat_len) {
+        return NO_MATCH;
+    }
+
+    uint64_t last = pat_len - 1;
+    uint64_t end = len - last;
+    const uint8x16_t first_b = vdupq_n_u8(pat[0]);
+    const uint8x16_t last_b  = vdupq_n_u8(pat[last]);
+
+    uint64_t i = 0;
+    for (; i + 16 <= end; i += 16) {
+        uint8x16_t hits = vandq_u8(vceqq_u8(vld1q_u8(data + i), first_b), vceqq_u8(vld1q_u8(data + i + last), last_b));
+
+        // Narrow the 16 compare lanes down to one nibble each
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask) / 4;
+            if (!memcmp(data + i + bit + 1, pat + 1, pat_len - 1)) {
+                return i + bit;
+            }
+            mask &= ~(0xFULL << (bit * 4));
+        }
+    }
+
+    for (; i < end; i++) {
+        if (data[i] == pat[0] && data[i + last] == pat[last] && !memcmp(data + i, pat, pat_len)) {
+            return i;
+        }
+    }
+
+    return NO_MATCH;
+}
+
+#else
+
+static uint64_t scan_block(uint8_t *data, uint64_t len, uint8_t *pat, uint64_t pat_len) {
+    uint8_t *hit = memmem(data, len, pat, pat_len);
+    return hit ? (uint64_t)(hit - data) : NO_MATCH;
+}
+
+#endif
+
+// Compares the pattern against the document starting inner bytes into the iterator's piece
+static bool match_across(File *file, PageCache *cache, PieceIter it, uint64_t inner, uint8_t *pat, uint64_t pat_len) {
+    uint64_t matched = 0;
+    for (Block *b; matched < pat_len && (b = piece_iter_block(&it)); piece_iter_next(&it)) {
+        while (matched < pat_len && inner < b->len) {
+            uint64_t avail;
+            uint8_t *bytes = block_bytes(file, cache, b, inner, &avail);
+            if (!avail) {
+                return false;
+            }
+
+            uint64_t cmp_len = MIN(pat_len - matched, avail);
+            if (memcmp(bytes, pat + matched, cmp_len)) {
+                return false;
+            }
+            matched += cmp_len;
+            inner += cmp_len;
+        }
+        inner = 0;
+    }
+
+    return matched == pat_len;
+}
+
+// Finds the first match starting in [start, end)
+uint64_t search_range(PieceTree *tree, File *file, PageCache *cache, uint8_t *pat, uint64_t pat_len, uint64_t start, uint64_t end) {
+    if (!pat_len) {
+        return NO_MATCH;
+    }
+
+    PieceIter it;
+    piece_iter_seek(&it, tree, start);
+    for (Block *b; (b = piece_iter_block(&it)) && it.offset < end; piece_iter_next(&it)) {
+        uint64_t inner = MAX(start, it.offset) - it.offset;
+        uint64_t inner_end = MIN(end - it.offset, b->len);
+
+        // A piece is readable in one span when mapped, and a page at a time when paged
+        while (inner < inner_end) {
+            uint64_t avail;
+            uint8_t *span = block_bytes(file, cache, b, inner, &avail);
+            if (!avail) {
+                return NO_MATCH;
+            }
+            uint64_t span_starts = MIN(avail, inner_end - inner);
+
+            // Matches that fit entirely in this span
+            uint64_t scan_len = MIN(avail, span_starts + pat_len - 1);
+            uint64_t hit = scan_block(span, scan_len, pat, pat_len);
+            if (hit != NO_MATCH) {
+                return it.offset + inner + hit;
+            }
+
+            // Matches that start in this span and run into the next ones
+            uint64_t tail_start = avail - MIN(avail, pat_len - 1);
+            for (uint64_t i = tail_start; i < span_starts; i++) {
+                if (span[i] == pat[0] && match_across(file, cache, it, inner + i, pat, pat_len)) {
+                    return it.offset + inner + i;
+                }
+            }
+
+            inner += span_starts;
+        }
+    }
+
+    return NO_MATCH;
+}
+
+// "text" searches for ascii, anything else is read as hex bytes, falling back to ascii
+uint64_t parse_pattern(const char *str, uint8_t *pat, uint64_t cap) {
+    if (str[0] == '"') {
+        uint64_t len = MIN(strlen(str + 1), cap);
+        if (len && str[len] == '"') {
+            len--;
+        }
+        memcpy(pat, str + 1, len);
+        return len;
+    }
+
+    uint64_t len = 0;
+    int nibbles = 0;
+    uint8_t cur = 0;
+    for (const char *c = str; *c; c++) {
+        if (*c == ' ') {
+            continue;
+        }
+
+        const char *digit = strchr(hex_digits, *c | 0x20);
+        if (!digit || len == cap) {
+            len = MIN(strlen(str), cap);
+            memcpy(pat, str, len);
+            return len;
+        }
+
+        cur = (cur << 4) | (digit - hex_digits);
+        if (++nibbles % 2 == 0) {
+            pat[len++] = cur;
+        }
+    }
+
+    if (nibbles % 2) {
+        len = MIN(strlen(str), cap);
+        memcpy(pat, str, len);
+    }
+    return len;
+}
+
+/*
+ * Background search
+ *
+ * The document is cut into fixed size chunks which a pool of workers pulls
+ * from. Each chunk keeps its own sorted list of match offsets (a match may
+ * run past the chunk's end, so nothing on a boundary gets lost), and the UI
+ * gets poked through a pipe every time a chunk finishes. Lookups only trust
+ * chunks that are done, so next/previous stay in offset order mid-scan.
+ * Workers read their own snapshot of the tree, which edits never touch.
+ */
+
+#define SEARCH_CHUNK_LEN (8 * 1024 * 1024)
+#define SEARCH_MAX_THREADS 16
+
+typedef struct {
+    uint64_t *data;
+    uint64_t len;
+    uint64_t cap;
+} OffsetArr;
+
+typedef struct {
+    OffsetArr matches;
+    atomic_bool done;
+} SearchChunk;
+
+typedef enum {
+    LOOKUP_FOUND,
+    LOOKUP_NONE,
+    LOOKUP_PENDING,
+} LookupResult;
+
+typedef struct {
+    PieceTree tree;
+    File *file;
+    uint8_t pat[256];
+    uint64_t pat_len;
+
+    SearchChunk *chunks;
+    uint64_t chunk_count;
+    uint64_t total_size;
+
+    atomic_uint_fast64_t next_chunk;
+    atomic_uint_fast64_t chunks_done;
+    atomic_uint_fast64_t match_count;
+    atomic_bool cancel;
+
+    pthread_t threads[SEARCH_MAX_THREADS];
+    int thread_count;
+    int wake_fds[2];
+    bool running;
+
+    // A jump the user asked for before the chunks it depends on were done
+    bool pending;
+    bool pending_forward;
+    uint64_t pending_start;
+} SearchJob;
+
+SearchJob search_job = {.wake_fds = {-1, -1}};
+
+#define SEARCH_CACHE_PAGES 8
+
+static void *search_worker(void *arg) {
+    SearchJob *job = arg;
+
+    PageCache cache;
+    page_cache_init(&cache, SEARCH_CACHE_PAGES);
+
+    while (!atomic_load(&job->cancel)) {
+        uint64_t idx = atomic_fetch_add(&job->next_chunk, 1);
+        if (idx >= job->chunk_count) {
+            break;
+        }
+
+        SearchChunk *c = &job->chunks[idx];
+        uint64_t start = idx * SEARCH_CHUNK_LEN;
+        uint64_t end = MIN(start + SEARCH_CHUNK_LEN, job->total_size);
+
+        tree_advise(&job->tree, job->file, start, end, ADVISE_SEQUENTIAL);
+        uint64_t hit = start;
+        while (!atomic_load_explicit(&job->cancel, memory_order_relaxed)) {
+            hit = search_range(&job->tree, job->file, &cache, job->pat, job->pat_len, hit, end);
+            if (hit == NO_MATCH) {
+                break;
+            }
+            ARR_APPEND(&c->matches, hit);
+            hit++;
+        }
+        tree_advise(&job->tree, job->file, start, end, ADVISE_DONE);
+
+        atomic_fetch_add(&job->match_count, c->matches.len);
+        atomic_store_explicit(&c->done, true, memory_order_release);
+        atomic_fetch_add(&job->chunks_done, 1);
+
+        char wake = 1;
+        write(job->wake_fds[1], &wake, 1);
+    }
+
+    page_cache_free(&cache);
+    return NULL;
+}
+
+void search_stop(SearchJob *job) {
+    if (job->running) {
+        atomic_store(&job->cancel, true);
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+
+    for (uint64_t i = 0; i < job->chunk_count; i++) {
+        free(job->chunks[i].matches.data);
+    }
+    free(job->chunks);
+    job->chunks = NULL;
+    job->chunk_count = 0;
+    job->pending = false;
+}
+
+void search_start(SearchJob *job, ViewState *view) {
+    search_stop(job);
+
+    if (job->wake_fds[0] < 0) {
+        pipe(job->wake_fds);
+        fcntl(job->wake_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(job->wake_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    job->tree = view->blocks;
+    job->file = &view->file;
+    job->pat_len = view->search_len;
+    memcpy(job->pat, view->search, view->search_len);
+    job->total_size = get_total_size(view);
+    job->chunk_count = (job->total_size + SEARCH_CHUNK_LEN - 1) / SEARCH_CHUNK_LEN;
+    job->chunks = calloc(MAX(job->chunk_count, 1), sizeof(SearchChunk));
+
+    atomic_store(&job->next_chunk, 0);
+    atomic_store(&job->chunks_done, 0);
+    atomic_store(&job->match_count, 0);
+    atomic_store(&job->cancel, false);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    job->thread_count = (int)MIN(MAX(cpus, 1), MIN(SEARCH_MAX_THREADS, MAX(job->chunk_count, 1)));
+    for (int i = 0; i < job->thread_count; i++) {
+        pthread_create(&job->threads[i], NULL, search_worker, job);
+    }
+    job->running = true;
+}
+
+bool search_finished(SearchJob *job) {
+    return atomic_load(&job->chunks_done) == job->chunk_count;
+}
+
+// Index of the first match >= offset
+static uint64_t chunk_lower_bound(OffsetArr *m, uint64_t offset) {
+    uint64_t lo = 0;
+    uint64_t hi = m->len;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (m->data[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Walks the chunks outwards from start, wrapping around the ends, and stops
+ * at the first match or at the first chunk that hasn't been scanned yet.
+ */
+LookupResult search_lookup(SearchJob *job, uint64_t start, bool forward, uint64_t *hit) {
+    if (!job->chunk_count) {
+        return LOOKUP_NONE;
+    }
+
+    uint64_t count = job->chunk_count;
+    uint64_t first = MIN(start / SEARCH_CHUNK_LEN, count - 1);
+    for (uint64_t step = 0; step <= count; step++) {
+        uint64_t idx = forward ? (first + step) % count : (first + count - (step % count)) % count;
+        SearchChunk *c = &job->chunks[idx];
+        if (!atomic_load_explicit(&c->done, memory_order_acquire)) {
+            return LOOKUP_PENDING;
+        }
+
+        // The first chunk gets visited twice, once on each side of start
+        OffsetArr *m = &c->matches;
+        uint64_t lo = 0;
+        uint64_t hi = m->len;
+        if (step == 0) {
+            *(forward ? &lo : &hi) = chunk_lower_bound(m, start);
+        } else if (step == count) {
+            *(forward ? &hi : &lo) = chunk_lower_bound(m, start);
+        }
+
+        if (lo < hi) {
+            *hit = forward ? m->data[lo] : m->data[hi - 1];
+            return LOOKUP_FOUND;
+        }
+    }
+
+    return LOOKUP_NONE;
+}
+
+/*
+ * Replace all
+ *
+ * Matches come from the background search, which already scans the whole
+ * document in parallel, so replacing them is just the batch path: every
+ * non-overlapping match, leftmost first, becomes an edit pointing at the
+ * same replacement piece, and the tree is rebuilt in one pass. However many
+ * matches there are, the replacement bytes are stored once.
+ */
+
+// Finishes the scan on this thread's time, since everything that follows needs all of it
+static void search_wait(SearchJob *job) {
+    if (job->running) {
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+}
+
+// Replaces every match of the current search as one edit, counting them in *count. The search is stale afterwards,
+// and if the edit can't be made the document is left as it was
+bool replace_all(ViewState *view, SearchJob *job, Block repl, uint64_t *count, uint64_t *first) {
+    if (!job->chunks) {
+        search_start(job, view);
+    }
+    search_wait(job);
+
+    EditArr edits = {0};
+    uint64_t next = 0;
+    for (uint64_t i = 0; i < job->chunk_count; i++) {
+        OffsetArr *m = &job->chunks[i].matches;
+        for (uint64_t k = chunk_lower_bound(m, next); k < m->len; k++) {
+            if (m->data[k] >= next) {
+                Edit e = {.offset = m->data[k], .len = job->pat_len, .block = repl, .seq = edits.len};
+                ARR_APPEND(&edits, e);
+                next = m->data[k] + job->pat_len;
+            }
+        }
+    }
+    search_stop(job);
+
+    Edit *bad;
+    bool ok = true;
+    if (edits.len) {
+        *first = edits.data[0].offset;
+        ok = apply_batch(view, &edits, &bad);
+    }
+    *count = ok ? edits.len : 0;
+    free(edits.data);
+    return ok;
+}
+
+/*
+ * Minimap
+ *
+ * Byte histograms of fixed chunks of the source file, filled in by worker
+ * threads. Pieces never change the source bytes under them, so each chunk
+ * is scanned once no matter how the document is edited. A minimap row adds
+ * up the histograms of whatever its slice of the document is made of, and
+ * counts edited bytes straight out of the add buffer.
+ */
+
+#define MINIMAP_MAX_CHUNKS 16384
+#define MINIMAP_MIN_CHUNK_LEN (64 * 1024)
+#define MINIMAP_PATCH_SAMPLE (64 * 1024)
+
+typedef struct {
+    uint32_t counts[256];
+} Histogram;
+
+typedef struct {
+    File *file;
+    uint64_t size;  // of the source when the scan started, a followed file grows past it
+    uint64_t chunk_len;
+    uint64_t chunk_count;
+    Histogram *hists;
+    atomic_bool *done;
+
+    atomic_uint_fast64_t next_chunk;
+    atomic_uint_fast64_t chunks_done;
+
+    pthread_t threads[SEARCH_MAX_THREADS];
+    int thread_count;
+    int wake_fds[2];
+    bool running;
+} MinimapJob;
+
+MinimapJob minimap_job = {.wake_fds = {-1, -1}};
+
+// Spreads the counting over four tables so a run of one byte value isn't a chain of dependent increments
+static void histogram_add(uint32_t *counts, const uint8_t *data, uint64_t len) {
+    uint32_t t[4][256] = {};
+
+    uint64_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        t[0][w & 0xFF]++;
+        t[1][(w >> 8) & 0xFF]++;
+        t[2][(w >> 16) & 0xFF]++;
+        t[3][(w >> 24) & 0xFF]++;
+        t[0][(w >> 32) & 0xFF]++;
+        t[1][(w >> 40) & 0xFF]++;
+        t[2][(w >> 48) & 0xFF]++;
+        t[3][w >> 56]++;
+    }
+    for (; i < len; i++) {
+        t[0][data[i]]++;
+    }
+
+    for (int b = 0; b < 256; b++) {
+        counts[b] += t[0][b] + t[1][b] + t[2][b] + t[3][b];
+    }
+}
+
+static void *minimap_worker(void *arg) {
+    MinimapJob *job = arg;
+
+    PageCache cache;
+    page_cache_init(&cache, SEARCH_CACHE_PAGES);
+
+    for (;;) {
+        uint64_t idx = atomic_fetch_add(&job->next_chunk, 1);
+        if (idx >= job->chunk_count) {
+            break;
+        }
+
+        uint64_t start = idx * job->chunk_len;
+        uint64_t end = MIN(start + job->chunk_len, job->size);
+        file_advise(job->file, start, end - start, ADVISE_SEQUENTIAL);
+        for (uint64_t offset = start; offset < end; ) {
+            uint64_t avail;
+            uint8_t *bytes = file_bytes(job->file, &cache, offset, &avail);
+            if (!avail) {
+                break;
+            }
+            avail = MIN(avail, end - offset);
+            histogram_add(job->hists[idx].counts, bytes, avail);
+            offset += avail;
+        }
+        file_advise(job->file, start, end - start, ADVISE_DONE);
+
+        atomic_store_explicit(&job->done[idx], true, memory_order_release);
+        atomic_fetch_add(&job->chunks_done, 1);
+
+        char wake = 1;
+        write(job->wake_fds[1], &wake, 1);
+    }
+
+    page_cache_free(&cache);
+    return NULL;
+}
+
+// Scans the source once, later calls are no-ops
+void minimap_start(MinimapJob *job, File *file) {
+    if (job->hists) {
+        return;
+    }
+
+    pipe(job->wake_fds);
+    fcntl(job->wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(job->wake_fds[1], F_SETFL, O_NONBLOCK);
+
+    // Power of two chunks, as few as it takes to stay under the cap
+    job->chunk_len = MINIMAP_MIN_CHUNK_LEN;
+    while (job->chunk_len * MINIMAP_MAX_CHUNKS < file->size) {
+        job->chunk_len *= 2;
+    }
+
+    job->file = file;
+    job->size = file->size;
+    job->chunk_count = (file->size + job->chunk_len - 1) / job->chunk_len;
+    job->hists = calloc(MAX(job->chunk_count, 1), sizeof(Histogram));
+    job->done = calloc(MAX(job->chunk_count, 1), sizeof(atomic_bool));
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    job->thread_count = (int)MIN(MAX(cpus, 1), MIN(SEARCH_MAX_THREADS, MAX(job->chunk_count, 1)));
+    for (int i = 0; i < job->thread_count; i++) {
+        pthread_create(&job->threads[i], NULL, minimap_worker, job);
+    }
+    job->running = true;
+}
+
+// Source bytes the file grew by after the scan get sampled straight off the file, like patches
+static void minimap_sample_grown(ViewState *view, uint64_t start, uint64_t end, double *counts) {
+    uint32_t sample[256] = {};
+    uint64_t sample_len = 0;
+    while (sample_len < MIN(end - start, MINIMAP_PATCH_SAMPLE)) {
+        uint64_t avail;
+        uint8_t *bytes = file_bytes(&view->file, &view->file.cache, start + sample_len, &avail);
+        if (!avail) {
+            break;
+        }
+        avail = MIN(avail, MINIMAP_PATCH_SAMPLE - sample_len);
+        histogram_add(sample, bytes, avail);
+        sample_len += avail;
+    }
+
+    double scale = sample_len ? (double)(end - start) / sample_len : 0;
+    for (int i = 0; i < 256; i++) {
+        counts[i] += sample[i] * scale;
+    }
+}
+
+// Adds the bytes of [start, end) of the document to counts, false if some of them aren't scanned yet
+static bool minimap_count(MinimapJob *job, ViewState *view, uint64_t start, uint64_t end, double *counts) {
+    bool ready = true;
+
+    PieceIter it;
+    piece_iter_seek(&it, &view->blocks, start);
+    for (Block *b; it.offset < end && (b = piece_iter_block(&it)); piece_iter_next(&it)) {
+        uint64_t lo = MAX(start, it.offset) - it.offset;
+        uint64_t hi = MIN(end, it.offset + b->len) - it.offset;
+
+        if (b->patch) {
+            // Big pastes and fills get sampled rather than counted in full every frame
+            uint32_t sample[256] = {};
+            uint64_t avail;
+            uint8_t *bytes = block_bytes(&view->file, &view->file.cache, b, lo, &avail);
+            uint64_t sample_len = MIN(MIN(hi - lo, avail), MINIMAP_PATCH_SAMPLE);
+            histogram_add(sample, bytes, sample_len);
+
+            double scale = (double)(hi - lo) / sample_len;
+            for (int i = 0; i < 256; i++) {
+                counts[i] += sample[i] * scale;
+            }
+            continue;
+        }
+
+        // Chunks only partly inside the range count in proportion to the overlap
+        uint64_t src_lo = b->start + lo;
+        uint64_t src_hi = b->start + hi;
+        if (src_hi > job->size) {
+            minimap_sample_grown(view, MAX(src_lo, job->size), src_hi, counts);
+            src_hi = MAX(src_lo, job->size);
+        }
+        for (uint64_t c = src_lo / job->chunk_len; c * job->chunk_len < src_hi; c++) {
+            if (!atomic_load_explicit(&job->done[c], memory_order_acquire)) {
+                ready = false;
+                continue;
+            }
+
+            uint64_t chunk_start = c * job->chunk_len;
+            uint64_t chunk_end = MIN(chunk_start + job->chunk_len, job->size);
+            uint64_t overlap = MIN(src_hi, chunk_end) - MAX(src_lo, chunk_start);
+            double scale = (double)overlap / (chunk_end - chunk_start);
+            for (int i = 0; i < 256; i++) {
+                counts[i] += job->hists[c].counts[i] * scale;
+            }
+        }
+    }
+
+    return ready;
+}
+
+// Splits the document into one slice per cell, rounded to whole rows so a jump lands on a row start
+uint64_t minimap_slice_len(uint64_t total_size, uint64_t cell_count) {
+    uint64_t slice = (total_size + cell_count - 1) / MAX(cell_count, 1);
+    return MAX((slice + 15) & ~15ULL, 16);
+}
+
+void minimap_cells(MinimapJob *job, ViewState *view, MinimapCell *cells, uint64_t cell_count, uint64_t visible_start, uint64_t visible_end) {
+    uint64_t total_size = get_total_size(view);
+    uint64_t slice = minimap_slice_len(total_size, cell_count);
+
+    for (uint64_t i = 0; i < cell_count; i++) {
+        uint64_t start = i * slice;
+        uint64_t end = MIN(start + slice, total_size);
+        MinimapCell *cell = &cells[i];
+        *cell = (MinimapCell){.kind = ' '};
+        if (start >= end) {
+            continue;
+        }
+
+        double counts[256] = {};
+        if (!minimap_count(job, view, start, end, counts)) {
+            cell->kind = '?';
+            continue;
+        }
+
+        double total = 0, text = 0;
+        for (int b = 0; b < 256; b++) {
+            total += counts[b];
+            if (b == '\t' || b == '\n' || b == '\r' || is_printable(b)) {
+                text += counts[b];
+            }
+        }
+
+        for (int b = 0; b < 256; b++) {
+            if (counts[b] > 0) {
+                double p = counts[b] / total;
+                cell->entropy -= p * log2(p);
+            }
+        }
+
+        if (counts[0] >= total * 0.9) {
+            cell->kind = 'Z';
+        } else if (text >= total * 0.9) {
+            cell->kind = 'A';
+        } else if (cell->entropy >= 7.2) {
+            cell->kind = 'H';
+        } else {
+            cell->kind = 'B';
+        }
+        cell->visible = start < visible_end && end > visible_start;
+    }
+}
+
+// Picks up chunks the workers finished since the last wakeup
+void minimap_update(MinimapJob *job) {
+    char drain[64];
+    while (read(job->wake_fds[0], drain, sizeof(drain)) > 0);
+
+    if (job->running && atomic_load(&job->chunks_done) == job->chunk_count) {
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+}
+
+/*
+ * Diffing
+ *
+ * --diff compares two documents in 8 MiB chunks on worker threads, like a
+ * search, and keeps the ranges that differ per chunk. The compare runs
+ * straight over the piece bytes, 64 bytes at a time, hunting alternately
+ * for the next mismatch and the next match. A run that crosses a chunk
+ * boundary is stored as two ranges that touch, and lookups stitch them
+ * back together.
+ */
+
+#define DIFF_CHUNK_LEN (8 * 1024 * 1024)
+
+// Past this a chunk's ranges get merged with their neighbours instead of added, so wildly different files don't eat memory
+#define DIFF_MAX_RANGES (64 * 1024)
+
+typedef struct {
+    RangeArr ranges;
+    atomic_bool done;
+} DiffChunk;
+
+typedef struct {
+    PieceTree trees[2];
+    File *files[2];
+    uint64_t sizes[2];
+
+    DiffChunk *chunks;
+    uint64_t chunk_count;
+    uint64_t total_size;
+
+    atomic_uint_fast64_t next_chunk;
+    atomic_uint_fast64_t chunks_done;
+    atomic_uint_fast64_t range_count;
+    atomic_bool cancel;
+
+    pthread_t threads[SEARCH_MAX_THREADS];
+    int thread_count;
+    int wake_fds[2];
+    bool running;
+
+    bool pending;
+    bool pending_forward;
+    uint64_t pending_start;
+} DiffJob;
+
+DiffJob diff_job = {.wake_fds = {-1, -1}};
+
+// Returns the first index where a and b are (want_equal) or aren't (!want_equal) the same, or len
+#if defined(__SSE2__)
+
+static uint64_t diff_scan(const uint8_t *a, const uint8_t *b, uint64_t len, bool want_equal) {
+    uint64_t flip = want_equal ? 0 : ~0ULL;
+
+    uint64_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t mask = 0;
+        for (int j = 0; j < 4; j++) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i + j * 16));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i + j * 16));
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) << (j * 16);
+        }
+
+        mask ^= flip;
+        if (mask) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+
+    for (; i < len; i++) {
+        if ((a[i] == b[i]) == want_equal) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#elif defined(__aarch64__)
+
+static uint64_t diff_scan(const uint8_t *a, const uint8_t *b, uint64_t len, bool want_equal) {
+    uint64_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t eq0 = vceqq_u8(vld1q_u8(a + i),      vld1q_u8(b + i));
+        uint8x16_t eq1 = vceqq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+        uint8x16_t eq2 = vceqq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+        uint8x16_t eq3 = vceqq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+
+        // Skip the whole block if every lane already says "keep going"
+        bool skip = want_equal
+            ? vmaxvq_u8(vorrq_u8(vorrq_u8(eq0, eq1), vorrq_u8(eq2, eq3))) == 0
+            : vminvq_u8(vandq_u8(vandq_u8(eq0, eq1), vandq_u8(eq2, eq3))) == 0xFF;
+        if (!skip) {
+            break;
+        }
+    }
+
+    for (; i < len; i++) {
+        if ((a[i] == b[i]) == want_equal) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#else
+
+static uint64_t diff_scan(const uint8_t *a, const uint8_t *b, uint64_t len, bool want_equal) {
+    uint64_t i = 0;
+    if (!want_equal) {
+        for (; i + 8 <= len; i += 8) {
+            uint64_t wa, wb;
+            memcpy(&wa, a + i, 8);
+            memcpy(&wb, b + i, 8);
+            if (wa != wb) {
+                break;
+            }
+        }
+    }
+
+    for (; i < len; i++) {
+        if ((a[i] == b[i]) == want_equal) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#endif
+
+// Bytes of the document at pos, moving the iterator forward onto the piece holding them
+static uint8_t *iter_bytes(PieceIter *it, PieceTree *tree, File *file, PageCache *cache, uint64_t pos, uint64_t *avail) {
+    Block *b = piece_iter_block(it);
+    while (b && pos >= it->offset + b->len) {
+        piece_iter_next(it);
+        b = piece_iter_block(it);
+    }
+    if (!b || pos < it->offset) {
+        piece_iter_seek(it, tree, pos);
+        if (!(b = piece_iter_block(it))) {
+            *avail = 0;
+            return NULL;
+        }
+    }
+    return block_bytes(file, cache, b, pos - it->offset, avail);
+}
+
+static void diff_add_range(RangeArr *ranges, uint64_t start, uint64_t end) {
+    Range *last = ranges->len ? &ranges->data[ranges->len - 1] : NULL;
+    if (last && (last->end == start || ranges->len >= DIFF_MAX_RANGES)) {
+        last->end = end;
+        return;
+    }
+    ARR_APPEND(ranges, ((Range){start, end}));
+}
+
+static void diff_chunk(DiffJob *job, PageCache *caches, uint64_t start, uint64_t end, RangeArr *ranges) {
+    uint64_t common = MIN(job->sizes[0], job->sizes[1]);
+    uint64_t stop = MIN(end, common);
+
+    PieceIter its[2] = {};
+    bool in_run = false;
+    uint64_t run_start = 0;
+    uint64_t pos = start;
+    while (pos < stop && !atomic_load_explicit(&job->cancel, memory_order_relaxed)) {
+        uint64_t a_avail, b_avail;
+        uint8_t *a = iter_bytes(&its[0], &job->trees[0], job->files[0], &caches[0], pos, &a_avail);
+        uint8_t *b = iter_bytes(&its[1], &job->trees[1], job->files[1], &caches[1], pos, &b_avail);
+        if (!a_avail || !b_avail) {
+            break;
+        }
+
+        uint64_t n = MIN(MIN(a_avail, b_avail), stop - pos);
+        uint64_t k = diff_scan(a, b, n, in_run);
+        pos += k;
+        if (k < n) {
+            if (in_run) {
+                diff_add_range(ranges, run_start, pos);
+            }
+            run_start = pos;
+            in_run = !in_run;
+        }
+    }
+    if (in_run) {
+        diff_add_range(ranges, run_start, pos);
+    }
+
+    // Whatever only one side has counts as different
+    if (end > common) {
+        diff_add_range(ranges, MAX(start, common), end);
+    }
+}
+
+static void *diff_worker(void *arg) {
+    DiffJob *job = arg;
+
+    PageCache caches[2];
+    page_cache_init(&caches[0], SEARCH_CACHE_PAGES);
+    page_cache_init(&caches[1], SEARCH_CACHE_PAGES);
+
+    while (!atomic_load(&job->cancel)) {
+        uint64_t idx = atomic_fetch_add(&job->next_chunk, 1);
+        if (idx >= job->chunk_count) {
+            break;
+        }
+
+        DiffChunk *c = &job->chunks[idx];
+        uint64_t start = idx * DIFF_CHUNK_LEN;
+        uint64_t end = MIN(start + DIFF_CHUNK_LEN, job->total_size);
+        for (int i = 0; i < 2; i++) {
+            tree_advise(&job->trees[i], job->files[i], start, end, ADVISE_SEQUENTIAL);
+        }
+        diff_chunk(job, caches, start, end, &c->ranges);
+        for (int i = 0; i < 2; i++) {
+            tree_advise(&job->trees[i], job->files[i], start, end, ADVISE_DONE);
+        }
+
+        atomic_fetch_add(&job->range_count, c->ranges.len);
+        atomic_store_explicit(&c->done, true, memory_order_release);
+        atomic_fetch_add(&job->chunks_done, 1);
+
+        char wake = 1;
+        write(job->wake_fds[1], &wake, 1);
+    }
+
+    page_cache_free(&caches[0]);
+    page_cache_free(&caches[1]);
+    return NULL;
+}
+
+void diff_stop(DiffJob *job) {
+    if (job->running) {
+        atomic_store(&job->cancel, true);
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+
+    for (uint64_t i = 0; i < job->chunk_count; i++) {
+        free(job->chunks[i].ranges.data);
+    }
+    free(job->chunks);
+    job->chunks = NULL;
+    job->chunk_count = 0;
+    job->pending = false;
+}
+
+void diff_start(DiffJob *job, ViewState *a, ViewState *b) {
+    diff_stop(job);
+
+    if (job->wake_fds[0] < 0) {
+        pipe(job->wake_fds);
+        fcntl(job->wake_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(job->wake_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    ViewState *views[2] = {a, b};
+    for (int i = 0; i < 2; i++) {
+        job->trees[i] = views[i]->blocks;
+        job->files[i] = &views[i]->file;
+        job->sizes[i] = get_total_size(views[i]);
+    }
+    job->total_size = MAX(job->sizes[0], job->sizes[1]);
+    job->chunk_count = (job->total_size + DIFF_CHUNK_LEN - 1) / DIFF_CHUNK_LEN;
+    job->chunks = calloc(MAX(job->chunk_count, 1), sizeof(DiffChunk));
+
+    atomic_store(&job->next_chunk, 0);
+    atomic_store(&job->chunks_done, 0);
+    atomic_store(&job->range_count, 0);
+    atomic_store(&job->cancel, false);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    job->thread_count = (int)MIN(MAX(cpus, 1), MIN(SEARCH_MAX_THREADS, MAX(job->chunk_count, 1)));
+    for (int i = 0; i < job->thread_count; i++) {
+        pthread_create(&job->threads[i], NULL, diff_worker, job);
+    }
+    job->running = true;
+}
+
+bool diff_finished(DiffJob *job) {
+    return atomic_load(&job->chunks_done) == job->chunk_count;
+}
+
+// The chunk's ranges if the workers are done with it, NULL if not
+static RangeArr *diff_chunk_ranges(DiffJob *job, uint64_t idx) {
+    DiffChunk *c = &job->chunks[idx];
+    return atomic_load_explicit(&c->done, memory_order_acquire) ? &c->ranges : NULL;
+}
+
+// Index of the first range in r ending after pos
+static uint64_t range_lower_bound(RangeArr *r, uint64_t pos) {
+    uint64_t lo = 0, hi = r->len;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (r->data[mid].end <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Walks pos out to the end (or back to the start) of the differing run it sits in, across chunk boundaries
+static LookupResult diff_run_edge(DiffJob *job, uint64_t *pos, bool forward) {
+    uint64_t p = *pos;
+    for (;;) {
+        uint64_t probe = forward ? p : p - 1;
+        if ((forward && p >= job->total_size) || (!forward && p == 0)) {
+            break;
+        }
+
+        RangeArr *r = diff_chunk_ranges(job, probe / DIFF_CHUNK_LEN);
+        if (!r) {
+            return LOOKUP_PENDING;
+        }
+
+        uint64_t i = range_lower_bound(r, probe);
+        if (i == r->len || r->data[i].start > probe) {
+            break;
+        }
+        p = forward ? r->data[i].end : r->data[i].start;
+    }
+
+    *pos = p;
+    return LOOKUP_FOUND;
+}
+
+// Finds the start of the next (or previous) differing run, skipping the one start is in
+LookupResult diff_lookup(DiffJob *job, uint64_t start, bool forward, uint64_t *hit) {
+    uint64_t p = MIN(start, job->total_size);
+    bool inside = false;
+    if (p < job->total_size) {
+        RangeArr *r = diff_chunk_ranges(job, p / DIFF_CHUNK_LEN);
+        if (!r) {
+            return LOOKUP_PENDING;
+        }
+        uint64_t i = range_lower_bound(r, p);
+        inside = i < r->len && r->data[i].start <= p;
+    }
+
+    if (forward) {
+        if (inside && diff_run_edge(job, &p, true) == LOOKUP_PENDING) {
+            return LOOKUP_PENDING;
+        }
+
+        for (uint64_t c = p / DIFF_CHUNK_LEN; c < job->chunk_count; c++) {
+            RangeArr *r = diff_chunk_ranges(job, c);
+            if (!r) {
+                return LOOKUP_PENDING;
+            }
+
+            uint64_t i = range_lower_bound(r, p);
+            if (i < r->len) {
+                *hit = MAX(r->data[i].start, p);
+                return LOOKUP_FOUND;
+            }
+        }
+        return LOOKUP_NONE;
+    }
+
+    if (inside && diff_run_edge(job, &p, false) == LOOKUP_PENDING) {
+        return LOOKUP_PENDING;
+    }
+
+    // p is now outside any run, so the last range starting before it is the one to go back to
+    for (uint64_t c = p ? (p - 1) / DIFF_CHUNK_LEN + 1 : 0; c-- > 0; ) {
+        RangeArr *r = diff_chunk_ranges(job, c);
+        if (!r) {
+            return LOOKUP_PENDING;
+        }
+
+        uint64_t i = range_lower_bound(r, p);
+        if (i > 0) {
+            *hit = r->data[i - 1].start;
+            return diff_run_edge(job, hit, false);
+        }
+    }
+    return LOOKUP_NONE;
+}
+
+/*
+ * Checksums
+ *
+ * CRC32C, SHA-256 and XXH64 of the document or a range of it. CRC32C is the
+ * one that keeps up with edits: two CRCs can be glued together with a bit
+ * of GF(2) arithmetic, so each piece node caches the CRC of its subtree and
+ * an edit only has to redo the path it copied. File pieces get theirs from
+ * a table of per-chunk CRCs of the source, filled in once by worker
+ * threads, so a piece only ever rereads the partial chunks at its ends.
+ * SHA-256 and XXH64 can't be split up like that, so they stream over a
+ * snapshot on a thread of their own and start over when the document
+ * changes.
+ */
+
+#define CRC32C_POLY 0x82F63B78  // bit reversed, like the CRC itself
+
+#define CRC_MAX_CHUNKS (64 * 1024)
+// bench.c shrinks this so its small fuzz inputs still span a few chunks
+#ifndef CRC_MIN_CHUNK_LEN
+#define CRC_MIN_CHUNK_LEN (1024 * 1024)
+#endif
+
+// A streamed hash pokes the UI about its progress every this many bytes
+#define HASH_WAKE_LEN (64 * 1024 * 1024)
+
+// How far ahead of itself a streamed hash asks the kernel to read
+#define SCAN_WINDOW_LEN (8 * 1024 * 1024)
+
+static const char *hash_names[] = {"off", "crc32c", "sha256", "xxh64"};
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_x2n[32];  // x^(2^n) mod P
+
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const uint8_t *data, uint64_t len);
+static Crc32cFn crc32c_raw = NULL;
+
+typedef void (*Sha256BlocksFn)(uint32_t *state, const uint8_t *data, uint64_t count);
+static Sha256BlocksFn sha256_blocks = NULL;
+
+// Slicing by 8 for CPUs without a crc32 instruction, the word loads assume little endian
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, uint64_t len) {
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, data, 8);
+        w ^= crc;
+        crc = crc32c_table[7][w & 0xFF] ^ crc32c_table[6][(w >> 8) & 0xFF] ^
+              crc32c_table[5][(w >> 16) & 0xFF] ^ crc32c_table[4][(w >> 24) & 0xFF] ^
+              crc32c_table[3][(w >> 32) & 0xFF] ^ crc32c_table[2][(w >> 40) & 0xFF] ^
+              crc32c_table[1][(w >> 48) & 0xFF] ^ crc32c_table[0][w >> 56];
+    }
+    for (; len; data++, len--) {
+        crc = crc32c_table[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// a * b mod P, both in the CRC's bit reversed order
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if (!(a & (m - 1))) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(n * 2^k) mod P
+static uint32_t crc32c_x2nmodp(uint64_t n, int k) {
+    uint32_t p = 1u << 31;
+    for (; n; n >>= 1, k++) {
+        if (n & 1) {
+            p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+        }
+    }
+    return p;
+}
+
+static inline uint32_t rotr32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+static inline uint64_t rotl64(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+
+static inline uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_blocks_scalar(uint32_t *state, const uint8_t *data, uint64_t count) {
+    for (; count; count--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + i * 4);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <immintrin.h>
+#include <cpuid.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, uint64_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, data, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; len; data++, len--) {
+        c = _mm_crc32_u8((uint32_t)c, *data);
+    }
+    return (uint32_t)c;
+}
+
+// Each sha256rnds2 does two rounds, on the state split into ABEF and CDGH halves
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state, const uint8_t *data, uint64_t count) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; count; count--, data += 64) {
+        __m128i abef_start = abef;
+        __m128i cdgh_start = cdgh;
+
+        // w holds the last four groups of four schedule words
+        __m128i w[4];
+        for (int i = 0; i < 16; i++) {
+            __m128i m;
+            if (i < 4) {
+                m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), bswap);
+            } else {
+                m = _mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]);
+                m = _mm_add_epi32(m, _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4));
+                m = _mm_sha256msg2_epu32(m, w[(i - 1) & 3]);
+            }
+            w[i & 3] = m;
+
+            __m128i wk = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+        }
+
+        abef = _mm_add_epi32(abef, abef_start);
+        cdgh = _mm_add_epi32(cdgh, cdgh_start);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32c_armv8(uint32_t crc, const uint8_t *data, uint64_t len) {
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, data, 8);
+        crc = __crc32cd(crc, w);
+    }
+    for (; len; data++, len--) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+
+#endif
+
+// Fills in the tables and picks the fastest kernels, the first call has to happen before any worker starts
+static void checksum_init(void) {
+    if (crc32c_raw) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+
+    uint32_t p = 1u << 30;  // x^1
+    for (int n = 0; n < 32; n++) {
+        crc32c_x2n[n] = p;
+        p = crc32c_multmodp(p, p);
+    }
+
+    sha256_blocks = sha256_blocks_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) && __builtin_cpu_supports("sse4.1")) {
+        sha256_blocks = sha256_blocks_shani;
+    }
+    crc32c_raw = __builtin_cpu_supports("sse4.2") ? crc32c_sse42 : crc32c_sw;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_raw = crc32c_armv8;
+#else
+    crc32c_raw = crc32c_sw;
+#endif
+}
+
+// Extends a finished CRC with more bytes, starting from 0 gives the CRC of just these
+uint32_t crc32c_extend(uint32_t crc, const uint8_t *data, uint64_t len) {
+    checksum_init();
+    return ~crc32c_raw(~crc, data, len);
+}
+
+// The CRC of a's bytes followed by b_len bytes whose CRC is b
+uint32_t crc32c_combine(uint32_t a, uint32_t b, uint64_t b_len) {
+    checksum_init();
+    return crc32c_multmodp(crc32c_x2nmodp(b_len, 3), a) ^ b;
+}
+
+typedef struct {
+    uint32_t state[8];
+    uint8_t buf[64];
+    uint64_t buf_len;
+    uint64_t total;
+} Sha256;
+
+void sha256_init(Sha256 *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    checksum_init();
+    *s = (Sha256){};
+    memcpy(s->state, iv, sizeof(iv));
+}
+
+void sha256_update(Sha256 *s, const uint8_t *data, uint64_t len) {
+    s->total += len;
+
+    if (s->buf_len) {
+        uint64_t take = MIN(len, 64 - s->buf_len);
+        memcpy(s->buf + s->buf_len, data, take);
+        s->buf_len += take;
+        data += take;
+        len -= take;
+        if (s->buf_len < 64) {
+            return;
+        }
+        sha256_blocks(s->state, s->buf, 1);
+        s->buf_len = 0;
+    }
+
+    sha256_blocks(s->state, data, len / 64);
+    s->buf_len = len % 64;
+    if (s->buf_len) {
+        memcpy(s->buf, data + len - s->buf_len, s->buf_len);
+    }
+}
+
+void sha256_final(Sha256 *s, uint8_t *digest) {
+    uint64_t bits = s->total * 8;
+    uint8_t pad[72] = {0x80};
+    uint64_t pad_len = (s->buf_len < 56 ? 56 : 120) - s->buf_len;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = bits >> (56 - i * 8);
+    }
+    sha256_update(s, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            digest[i * 4 + j] = s->state[i] >> (24 - j * 8);
+        }
+    }
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t acc[4];
+    uint8_t buf[32];
+    uint64_t buf_len;
+    uint64_t total;
+} Xxh64;
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t h, uint64_t acc) {
+    return (h ^ xxh64_round(0, acc)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64_stripes(uint64_t *acc, const uint8_t *data, uint64_t count) {
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    for (; count; count--, data += 32) {
+        uint64_t w[4];
+        memcpy(w, data, 32);
+        a0 = xxh64_round(a0, w[0]);
+        a1 = xxh64_round(a1, w[1]);
+        a2 = xxh64_round(a2, w[2]);
+        a3 = xxh64_round(a3, w[3]);
+    }
+    acc[0] = a0; acc[1] = a1; acc[2] = a2; acc[3] = a3;
+}
+
+void xxh64_init(Xxh64 *x, uint64_t seed) {
+    *x = (Xxh64){.acc = {seed + XXH_PRIME64_1 + XXH_PRIME64_2, seed + XXH_PRIME64_2, seed, seed - XXH_PRIME64_1}};
+}
+
+void xxh64_update(Xxh64 *x, const uint8_t *data, uint64_t len) {
+    x->total += len;
+
+    if (x->buf_len) {
+        uint64_t take = MIN(len, 32 - x->buf_len);
+        memcpy(x->buf + x->buf_len, data, take);
+        x->buf_len += take;
+        data += take;
+        len -= take;
+        if (x->buf_len < 32) {
+            return;
+        }
+        xxh64_stripes(x->acc, x->buf, 1);
+        x->buf_len = 0;
+    }
+
+    xxh64_stripes(x->acc, data, len / 32);
+    x->buf_len = len % 32;
+    if (x->buf_len) {
+        memcpy(x->buf, data + len - x->buf_len, x->buf_len);
+    }
+}
+
+uint64_t xxh64_final(Xxh64 *x) {
+    uint64_t h;
+    if (x->total >= 32) {
+        h = rotl64(x->acc[0], 1) + rotl64(x->acc[1], 7) + rotl64(x->acc[2], 12) + rotl64(x->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh64_merge(h, x->acc[i]);
+        }
+    } else {
+        h = x->acc[2] + XXH_PRIME64_5;
+    }
+    h += x->total;
+
+    const uint8_t *p = x->buf;
+    uint64_t len = x->buf_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = rotl64(h ^ xxh64_round(0, w), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        h = rotl64(h ^ (w * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len; p++, len--) {
+        h = rotl64(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef struct {
+    File *file;
+    uint64_t size;  // of the source when the table was started, a followed file grows past it
+    uint32_t *crcs;
+    uint64_t chunk_len;
+    uint64_t chunk_count;
+    uint32_t chunk_shift;  // x^(8 * chunk_len), steps a CRC over one whole chunk
+
+    atomic_uint_fast64_t next_chunk;
+    atomic_uint_fast64_t chunks_done;
+    atomic_bool cancel;
+
+    pthread_t threads[SEARCH_MAX_THREADS];
+    int thread_count;
+    int wake_fds[2];
+    bool running;
+} CrcJob;
+
+CrcJob crc_job = {.wake_fds = {-1, -1}};
+
+// Piece CRCs cached under an older epoch were built from source bytes that have since been rewritten
+uint32_t crc_epoch = 1;
+
+// Extends crc with the source bytes [offset, offset + len)
+static uint32_t crc_file_bytes(uint32_t crc, File *file, PageCache *cache, uint64_t offset, uint64_t len) {
+    while (len) {
+        uint64_t avail;
+        uint8_t *bytes = file_bytes(file, cache, offset, &avail);
+        if (!avail) {
+            break;
+        }
+        avail = MIN(avail, len);
+        crc = crc32c_extend(crc, bytes, avail);
+        offset += avail;
+        len -= avail;
+    }
+    return crc;
+}
+
+static void *crc_worker(void *arg) {
+    CrcJob *job = arg;
+
+    PageCache cache;
+    page_cache_init(&cache, SEARCH_CACHE_PAGES);
+
+    while (!atomic_load(&job->cancel)) {
+        uint64_t idx = atomic_fetch_add(&job->next_chunk, 1);
+        if (idx >= job->chunk_count) {
+            break;
+        }
+
+        uint64_t start = idx * job->chunk_len;
+        uint64_t end = MIN(start + job->chunk_len, job->size);
+        file_advise(job->file, start, end - start, ADVISE_SEQUENTIAL);
+        job->crcs[idx] = crc_file_bytes(0, job->file, &cache, start, end - start);
+        file_advise(job->file, start, end - start, ADVISE_DONE);
+        atomic_fetch_add_explicit(&job->chunks_done, 1, memory_order_release);
+
+        char wake = 1;
+        write(job->wake_fds[1], &wake, 1);
+    }
+
+    page_cache_free(&cache);
+    return NULL;
+}
+
+void crc_stop(CrcJob *job) {
+    if (job->running) {
+        atomic_store(&job->cancel, true);
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+
+    free(job->crcs);
+    job->crcs = NULL;
+    job->chunk_count = 0;
+}
+
+// (Re)builds the chunk table of file, dropping every piece CRC built from the old one
+void crc_start(CrcJob *job, File *file) {
+    crc_stop(job);
+    checksum_init();
+    crc_epoch++;
+
+    if (job->wake_fds[0] < 0) {
+        pipe(job->wake_fds);
+        fcntl(job->wake_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(job->wake_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    job->chunk_len = CRC_MIN_CHUNK_LEN;
+    while (job->chunk_len * CRC_MAX_CHUNKS < file->size) {
+        job->chunk_len *= 2;
+    }
+
+    job->file = file;
+    job->size = file->size;
+    job->chunk_count = (file->size + job->chunk_len - 1) / job->chunk_len;
+    job->chunk_shift = crc32c_x2nmodp(job->chunk_len, 3);
+    job->crcs = calloc(MAX(job->chunk_count, 1), sizeof(uint32_t));
+
+    atomic_store(&job->next_chunk, 0);
+    atomic_store(&job->chunks_done, 0);
+    atomic_store(&job->cancel, false);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    job->thread_count = (int)MIN(MAX(cpus, 1), MIN(SEARCH_MAX_THREADS, MAX(job->chunk_count, 1)));
+    for (int i = 0; i < job->thread_count; i++) {
+        pthread_create(&job->threads[i], NULL, crc_worker, job);
+    }
+    job->running = true;
+}
+
+bool crc_ready(CrcJob *job) {
+    return job->crcs && atomic_load_explicit(&job->chunks_done, memory_order_acquire) == job->chunk_count;
+}
+
+// Picks up chunks the workers finished since the last wakeup
+void crc_update(CrcJob *job) {
+    char drain[64];
+    while (read(job->wake_fds[0], drain, sizeof(drain)) > 0);
+
+    if (job->running && crc_ready(job)) {
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+}
+
+// A fill is its tile over and over, so whole tiles get combined by doubling instead of hashed
+static uint32_t crc_fill(Block *b, uint64_t inner, uint64_t len) {
+    uint64_t tile_len = fill_tile_len(b->fill_period);
+    uint64_t pos = (b->fill_phase + inner) % b->fill_period;
+    uint64_t head = MIN(len, tile_len - pos);
+    uint32_t crc = crc32c_extend(0, b->data + pos, head);
+    len -= head;
+
+    uint32_t tiles_crc = crc32c_extend(0, b->data, tile_len);
+    uint64_t tiles_len = tile_len;
+    for (uint64_t count = len / tile_len; count; count >>= 1) {
+        if (count & 1) {
+            crc = crc32c_combine(crc, tiles_crc, tiles_len);
+        }
+        tiles_crc = crc32c_combine(tiles_crc, tiles_crc, tiles_len);
+        tiles_len *= 2;
+    }
+    return crc32c_extend(crc, b->data, len % tile_len);
+}
+
+// CRC of len bytes of b from inner on, the whole source chunks in there come out of the table
+static uint32_t crc_block(CrcJob *job, File *file, Block *b, uint64_t inner, uint64_t len) {
+    if (b->fill) {
+        return crc_fill(b, inner, len);
+    }
+    if (b->patch) {
+        return crc32c_extend(0, b->data + inner, len);
+    }
+
+    uint64_t start = b->start + inner;
+    uint64_t end = start + len;
+    uint64_t first = (start + job->chunk_len - 1) / job->chunk_len;
+    uint64_t last = MIN(end, job->size) / job->chunk_len;
+    if (first >= last) {
+        return crc_file_bytes(0, file, &file->cache, start, len);
+    }
+
+    uint32_t crc = crc_file_bytes(0, file, &file->cache, start, first * job->chunk_len - start);
+    for (uint64_t i = first; i < last; i++) {
+        crc = crc32c_multmodp(job->chunk_shift, crc) ^ job->crcs[i];
+    }
+    return crc_file_bytes(crc, file, &file->cache, last * job->chunk_len, end - last * job->chunk_len);
+}
+
+static uint32_t piece_crc(CrcJob *job, File *file, PieceNode *n) {
+    if (!n) {
+        return 0;
+    }
+
+    if (n->crc_epoch != crc_epoch) {
+        uint32_t crc = piece_crc(job, file, n->left);
+        crc = crc32c_combine(crc, crc_block(job, file, &n->block, 0, n->block.len), n->block.len);
+        n->crc = crc32c_combine(crc, piece_crc(job, file, n->right), piece_size(n->right));
+        n->crc_epoch = crc_epoch;
+    }
+    return n->crc;
+}
+
+// CRC of [start, end) of n's subtree, using the cached CRC of every subtree that's covered whole
+static uint32_t piece_crc_range(CrcJob *job, File *file, PieceNode *n, uint64_t start, uint64_t end) {
+    if (!n || start >= end) {
+        return 0;
+    }
+    if (start == 0 && end == n->size) {
+        return piece_crc(job, file, n);
+    }
+
+    uint64_t b_head = piece_size(n->left);
+    uint64_t b_tail = b_head + n->block.len;
+
+    uint32_t crc = piece_crc_range(job, file, n->left, start, MIN(end, b_head));
+    if (start < b_tail && end > b_head) {
+        uint64_t lo = MAX(start, b_head);
+        uint64_t hi = MIN(end, b_tail);
+        crc = crc32c_combine(crc, crc_block(job, file, &n->block, lo - b_head, hi - lo), hi - lo);
+    }
+    if (end > b_tail) {
+        uint64_t lo = MAX(start, b_tail);
+        crc = crc32c_combine(crc, piece_crc_range(job, file, n->right, lo - b_tail, end - b_tail), end - lo);
+    }
+    return crc;
+}
+
+// The CRC32C of [start, end) of the document, false until the chunk table is done
+bool crc_range(CrcJob *job, ViewState *view, uint64_t start, uint64_t end, uint32_t *crc) {
+    if (!crc_ready(job) || job->file != &view->file) {
+        return false;
+    }
+    *crc = piece_crc_range(job, &view->file, view->blocks.root, start, end);
+    return true;
+}
+
+typedef struct {
+    HashKind kind;
+    PieceTree tree;
+    uint64_t edit_count;  // of the document the tree was taken from
+    File *file;
+    uint64_t start;
+    uint64_t end;
+
+    // digest_len stays 0 if the document couldn't be read
+    uint8_t digest[32];
+    uint64_t digest_len;
+
+    atomic_uint_fast64_t hashed;
+    atomic_bool done;
+    atomic_bool cancel;
+
+    pthread_t thread;
+    int wake_fds[2];
+    bool running;
+} HashJob;
+
+HashJob hash_job = {.wake_fds = {-1, -1}};
+
+static void *hash_worker(void *arg) {
+    HashJob *job = arg;
+
+    PageCache cache;
+    page_cache_init(&cache, SEARCH_CACHE_PAGES);
+
+    Sha256 sha;
+    Xxh64 xxh;
+    sha256_init(&sha);
+    xxh64_init(&xxh, 0);
+
+    PieceIter it;
+    piece_iter_seek(&it, &job->tree, job->start);
+    uint64_t pos = job->start;
+    uint64_t next_wake = pos + HASH_WAKE_LEN;
+    uint64_t window = pos;
+    char wake = 1;
+    tree_advise(&job->tree, job->file, window, MIN(window + SCAN_WINDOW_LEN, job->end), ADVISE_SEQUENTIAL);
+    while (pos < job->end && !atomic_load_explicit(&job->cancel, memory_order_relaxed)) {
+        // Reads ahead one window and lets go of the one behind
+        if (pos >= window + SCAN_WINDOW_LEN) {
+            tree_advise(&job->tree, job->file, window, window + SCAN_WINDOW_LEN, ADVISE_DONE);
+            window += SCAN_WINDOW_LEN;
+            tree_advise(&job->tree, job->file, window, MIN(window + SCAN_WINDOW_LEN, job->end), ADVISE_SEQUENTIAL);
+        }
+
+        uint64_t avail;
+        uint8_t *bytes = iter_bytes(&it, &job->tree, job->file, &cache, pos, &avail);
+        if (!avail) {
+            break;
+        }
+        avail = MIN(avail, job->end - pos);
+
+        if (job->kind == HASH_SHA256) {
+            sha256_update(&sha, bytes, avail);
+        } else {
+            xxh64_update(&xxh, bytes, avail);
+        }
+        pos += avail;
+        atomic_store_explicit(&job->hashed, pos - job->start, memory_order_relaxed);
+
+        if (pos >= next_wake) {
+            next_wake = pos + HASH_WAKE_LEN;
+            write(job->wake_fds[1], &wake, 1);
+        }
+    }
+
+    tree_advise(&job->tree, job->file, window, MIN(window + SCAN_WINDOW_LEN, job->end), ADVISE_DONE);
+
+    if (!atomic_load(&job->cancel)) {
+        if (pos == job->end && job->kind == HASH_SHA256) {
+            sha256_final(&sha, job->digest);
+            job->digest_len = 32;
+        } else if (pos == job->end) {
+            uint64_t h = xxh64_final(&xxh);
+            for (int i = 0; i < 8; i++) {
+                job->digest[i] = h >> (56 - i * 8);
+            }
+            job->digest_len = 8;
+        }
+        atomic_store_explicit(&job->done, true, memory_order_release);
+        write(job->wake_fds[1], &wake, 1);
+    }
+
+    page_cache_free(&cache);
+    return NULL;
+}
+
+void hash_stop(HashJob *job) {
+    if (job->running) {
+        atomic_store(&job->cancel, true);
+        pthread_join(job->thread, NULL);
+        job->running = false;
+    }
+    job->kind = HASH_NONE;
+}
+
+// Hashes [start, end) of the view's document as it is now, CRC32C gets worked out on the spot once its table is ready
+void hash_start(HashJob *job, ViewState *view, HashKind kind, uint64_t start, uint64_t end) {
+    hash_stop(job);
+    checksum_init();
+
+    if (job->wake_fds[0] < 0) {
+        pipe(job->wake_fds);
+        fcntl(job->wake_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(job->wake_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    job->kind = kind;
+    job->tree = view->blocks;
+    job->edit_count = view->edit_count;
+    job->file = &view->file;
+    job->start = start;
+    job->end = end;
+    job->digest_len = 0;
+    atomic_store(&job->hashed, 0);
+    atomic_store(&job->done, false);
+    atomic_store(&job->cancel, false);
+
+    if (kind == HASH_CRC32C) {
+        uint32_t crc;
+        if (crc_range(&crc_job, view, start, end, &crc)) {
+            for (int i = 0; i < 4; i++) {
+                job->digest[i] = crc >> (24 - i * 8);
+            }
+            job->digest_len = 4;
+            atomic_store(&job->hashed, end - start);
+            atomic_store(&job->done, true);
+        }
+        return;
+    }
+
+    pthread_create(&job->thread, NULL, hash_worker, job);
+    job->running = true;
+}
+
+// Picks up the digest (or some progress) from the hashing thread
+void hash_update(HashJob *job) {
+    char drain[64];
+    while (read(job->wake_fds[0], drain, sizeof(drain)) > 0);
+
+    if (job->running && atomic_load_explicit(&job->done, memory_order_acquire)) {
+        pthread_join(job->thread, NULL);
+        job->running = false;
+    }
+}
+
+/*
+ * Saving
+ *
+ * The edited document is streamed out to a temp file next to the original
+ * and renamed over it. Pieces that still point into the original mapping
+ * are handed to the kernel (reflinked if the filesystem can share extents,
+ * copy_file_range otherwise), only patched and inserted bytes get written
+ * from userspace. Zero fills aren't written at all, they're left as holes.
+ */
+
+#define SAVE_BUF_LEN (64 * 1024)
+
+typedef struct {
+    int fd;
+    uint64_t offset;
+
+    uint8_t *buf;
+    uint64_t buf_len;
+
+    uint64_t blksize;
+    bool can_clone;
+    bool can_copy;
+    bool stream;  // pipes can't take positioned writes, only write() in order
+    uint64_t sparse_from;  // the output holds nothing from here on, so a hole reads back as zeros
+} SaveWriter;
+
+
+static bool write_all(int fd, uint64_t offset, uint8_t *data, uint64_t len) {
+    while (len) {
+        ssize_t ret = pwrite(fd, data, len, offset);
+        stats.disk_writes++;
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        stats.disk_bytes += ret;
+
+        data += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool save_emit(SaveWriter *w, uint8_t *data, uint64_t len) {
+    if (!w->stream) {
+        if (!write_all(w->fd, w->offset, data, len)) {
+            return false;
+        }
+        w->offset += len;
+        return true;
+    }
+
+    while (len) {
+        ssize_t ret = write(w->fd, data, len);
+        stats.disk_writes++;
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        stats.disk_bytes += ret;
+
+        data += ret;
+        w->offset += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool save_flush(SaveWriter *w) {
+    if (!w->buf_len) {
+        return true;
+    }
+
+    if (!save_emit(w, w->buf, w->buf_len)) {
+        return false;
+    }
+    w->buf_len = 0;
+    return true;
+}
+
+static bool save_write(SaveWriter *w, uint8_t *data, uint64_t len) {
+    // Small pieces get batched, big ones skip the staging copy
+    if (w->buf_len + len > SAVE_BUF_LEN) {
+        if (!save_flush(w)) {
+            return false;
+        }
+
+        if (len > SAVE_BUF_LEN) {
+            return save_emit(w, data, len);
+        }
+    }
+
+    memcpy(w->buf + w->buf_len, data, len);
+    w->buf_len += len;
+    return true;
+}
+
+// Punches out zeros where the output already has bytes and skips over them past its end
+static bool save_zeros(SaveWriter *w, uint64_t len) {
+    if (!save_flush(w)) {
+        return false;
+    }
+
+    if (!w->stream && w->offset < w->sparse_from) {
+        uint64_t punch = MIN(len, w->sparse_from - w->offset);
+        stats.disk_writes++;
+        if (fallocate(w->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, w->offset, punch) == 0) {
+            w->offset += punch;
+            len -= punch;
+        }
+    }
+    if (!w->stream && w->offset >= w->sparse_from) {
+        w->offset += len;
+        return true;
+    }
+
+    // Pipes, and anything that can't punch holes, get the zeros written out
+    while (len) {
+        uint64_t chunk = MIN(len, FILL_TILE_LEN);
+        if (!save_emit(w, fill_zero_tile, chunk)) {
+            return false;
+        }
+        len -= chunk;
+    }
+    return true;
+}
+
+static bool save_fill(SaveWriter *w, File *file, Block *b) {
+    if (fill_is_zero(b)) {
+        return save_zeros(w, b->len);
+    }
+
+    for (uint64_t inner = 0; inner < b->len; ) {
+        uint64_t avail;
+        uint8_t *bytes = block_bytes(file, &file->cache, b, inner, &avail);
+        if (!save_write(w, bytes, avail)) {
+            return false;
+        }
+        inner += avail;
+    }
+    return true;
+}
+
+static bool save_copy_range(SaveWriter *w, File *file, uint64_t in_off, uint64_t len) {
+    while (len && w->can_copy) {
+        loff_t src = in_off;
+        loff_t dst = w->offset;
+        ssize_t ret = copy_file_range(file->fd, &src, w->fd, &dst, len, 0);
+        stats.disk_writes++;
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) {
+                w->can_copy = false;
+                break;
+            }
+            return false;
+        }
+        if (ret == 0) {
+            break;
+        }
+
+        in_off += ret;
+        w->offset += ret;
+        len -= ret;
+        stats.disk_bytes += ret;
+    }
+
+    // No kernel-side copy available, push it through userspace instead
+    while (len) {
+        uint64_t avail;
+        uint8_t *bytes = file_bytes(file, &file->cache, in_off, &avail);
+        avail = MIN(avail, len);
+        if (!avail || !save_emit(w, bytes, avail)) {
+            return false;
+        }
+
+        in_off += avail;
+        len -= avail;
+    }
+    return true;
+}
+
+static bool save_copy(SaveWriter *w, File *file, Block *b) {
+    if (!save_flush(w)) {
+        return false;
+    }
+
+    uint64_t in_off = b->start;
+    uint64_t len = b->len;
+
+    // Extents can only be shared if source and dest sit at the same block alignment
+    if (w->can_clone && len >= w->blksize && (in_off % w->blksize) == (w->offset % w->blksize)) {
+        uint64_t head = (w->blksize - (in_off % w->blksize)) % w->blksize;
+        uint64_t clone_len = (len - head) - ((len - head) % w->blksize);
+
+        if (clone_len) {
+            if (!save_copy_range(w, file, in_off, head)) {
+                return false;
+            }
+
+            struct file_clone_range range = {
+                .src_fd = file->fd,
+                .src_offset = in_off + head,
+                .src_length = clone_len,
+                .dest_offset = w->offset,
+            };
+            stats.disk_writes++;
+            if (ioctl(w->fd, FICLONERANGE, &range) == 0) {
+                w->offset += clone_len;
+                return save_copy_range(w, file, in_off + head + clone_len, len - head - clone_len);
+            }
+
+            w->can_clone = false;
+            return save_copy_range(w, file, in_off + head, len - head);
+        }
+    }
+
+    return save_copy_range(w, file, in_off, len);
+}
+
+/*
+ * When the document is still the same length and every untouched piece
+ * sits where it started, only the patched/inserted ranges differ from
+ * what's on disk. Those get written straight into the original file.
+ */
+static bool can_save_in_place(ViewState *view) {
+    File *file = &view->file;
+    if (!file->writable || file->detached || get_total_size(view) != file->size) {
+        return false;
+    }
+
+    PieceIter it;
+    for (piece_iter_seek(&it, &view->blocks, 0); piece_iter_block(&it); piece_iter_next(&it)) {
+        Block *b = piece_iter_block(&it);
+        if (!b->patch && b->start != it.offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool writev_all(int fd, uint64_t offset, struct iovec *iov, int iov_len) {
+    while (iov_len) {
+        ssize_t ret = pwritev(fd, iov, iov_len, offset);
+        stats.disk_writes++;
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        stats.disk_bytes += ret;
+        offset += ret;
+
+        while (iov_len && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iov_len--;
+        }
+        if (iov_len) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+#define SAVE_IOV_LEN 256
+
+/*
+ * Older versions can still have pieces that read the original bytes of a
+ * range we're about to overwrite. Writing to the private mapping gives
+ * those pages their own copy, so they keep the old contents after the file
+ * underneath changes.
+ */
+static void pin_mapped_range(File *file, uint64_t offset, uint64_t len) {
+    if (file->kind != SOURCE_MMAP) {
+        return;
+    }
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - (offset % page);
+    uint64_t end = MIN(offset + len, file->size);
+
+    // The journal can't point at these bytes on disk any more, pieces over them have to be written out
+    file_mark_overwritten(file, offset, end);
+
+    if (mprotect(file->data + start, end - start, PROT_READ | PROT_WRITE)) {
+        return;
+    }
+    for (uint64_t p = start; p < end; p += page) {
+        volatile uint8_t *b = file->data + p;
+        *b = *b;
+    }
+    mprotect(file->data + start, end - start, PROT_READ);
+}
+
+static bool write_dirty_run(File *file, uint64_t offset, struct iovec *iov, int iov_len) {
+    uint64_t len = 0;
+    for (int i = 0; i < iov_len; i++) {
+        len += iov[i].iov_len;
+    }
+
+    pin_mapped_range(file, offset, len);
+    return writev_all(file->fd, offset, iov, iov_len);
+}
+
+// Zero fills get punched out, which devices turn into a discard or zeroing, other fills go a tile at a time
+static bool write_fill(File *file, uint64_t offset, Block *b) {
+    pin_mapped_range(file, offset, b->len);
+    stats.disk_writes++;
+    if (fill_is_zero(b) && fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, b->len) == 0) {
+        return true;
+    }
+
+    struct iovec iov[SAVE_IOV_LEN];
+    for (uint64_t inner = 0; inner < b->len; ) {
+        uint64_t run_start = inner;
+        int iov_len = 0;
+        while (iov_len < SAVE_IOV_LEN && inner < b->len) {
+            uint64_t avail;
+            uint8_t *bytes = block_bytes(file, &file->cache, b, inner, &avail);
+            iov[iov_len++] = (struct iovec){.iov_base = bytes, .iov_len = avail};
+            inner += avail;
+        }
+        if (!writev_all(file->fd, offset + run_start, iov, iov_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool save_in_place(ViewState *view) {
+    File *file = &view->file;
+
+    struct iovec iov[SAVE_IOV_LEN];
+    int iov_len = 0;
+    uint64_t run_offset = 0;
+
+    PieceIter it;
+    for (piece_iter_seek(&it, &view->blocks, 0); piece_iter_block(&it); piece_iter_next(&it)) {
+        Block *b = piece_iter_block(&it);
+
+        // A source piece over what an earlier save wrote still reads the bytes from before it, which aren't on disk
+        bool clean = !b->patch && !file_overwritten(file, b->start, b->len);
+        if (iov_len && (clean || b->fill || iov_len == SAVE_IOV_LEN)) {
+            if (!write_dirty_run(file, run_offset, iov, iov_len)) {
+                return false;
+            }
+            iov_len = 0;
+        }
+        if (clean) {
+            continue;
+        }
+        if (b->fill) {
+            if (!write_fill(file, it.offset, b)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (!iov_len) {
+            run_offset = it.offset;
+        }
+        iov[iov_len++] = (struct iovec){.iov_base = b->patch ? b->data : file->data + b->start, .iov_len = b->len};
+    }
+
+    if (iov_len && !write_dirty_run(file, run_offset, iov, iov_len)) {
+        return false;
+    }
+
+    /*
+     * Paged reads go back to the disk, where there's nothing left of the
+     * old bytes to pin, so the history from before this save has to go,
+     * and so does a clipboard that may point at them.
+     */
+    if (file->kind == SOURCE_PAGED) {
+        page_cache_clear(&file->cache);
+        view->history.data[0] = view->history.data[view->version];
+        view->history.len = 1;
+        view->version = 0;
+        view->clipboard.root = NULL;
+    }
+
+    return fdatasync(file->fd) == 0;
+}
+
+// Writes the whole document to fd from its current position
+bool save_to_fd(ViewState *view, int fd) {
+    struct stat out_info;
+    if (fstat(fd, &out_info)) {
+        return false;
+    }
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    SaveWriter w = {
+        .fd = fd,
+        .offset = MAX(pos, 0),
+        .buf = malloc(SAVE_BUF_LEN),
+        .blksize = MAX(out_info.st_blksize, 1),
+        .can_clone = pos >= 0,
+        .can_copy = pos >= 0,
+        .stream = pos < 0,
+        .sparse_from = S_ISREG(out_info.st_mode) ? (uint64_t)out_info.st_size : UINT64_MAX,
+    };
+
+    bool ok = true;
+    PieceIter it;
+    for (piece_iter_seek(&it, &view->blocks, 0); ok && piece_iter_block(&it); piece_iter_next(&it)) {
+        Block *b = piece_iter_block(&it);
+        if (!b->patch) {
+            file_advise(&view->file, b->start, b->len, ADVISE_SEQUENTIAL);
+            ok = save_copy(&w, &view->file, b);
+            file_advise(&view->file, b->start, b->len, ADVISE_DONE);
+        } else if (b->fill) {
+            ok = save_fill(&w, &view->file, b);
+        } else {
+            ok = save_write(&w, b->data, b->len);
+        }
+    }
+
+    ok = ok && save_flush(&w);
+
+    // A hole at the very end doesn't make the file any longer by itself
+    if (ok && !w.stream && w.offset > w.sparse_from) {
+        struct stat info;
+        ok = !fstat(fd, &info) && ((uint64_t)info.st_size >= w.offset || !ftruncate(fd, w.offset));
+    }
+    free(w.buf);
+    return ok;
+}
+
+// Writes the document to a temp file beside name, then renames it over name
+bool save_as(ViewState *view, const char *name, mode_t mode) {
+    char tmp_name[PATH_MAX];
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", name) >= (int)sizeof(tmp_name)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    int fd = mkstemp(tmp_name);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = save_to_fd(view, fd);
+    ok = ok && fchmod(fd, mode & 07777) == 0;
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp_name, name)) {
+        int err = errno;
+        unlink(tmp_name);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+bool save_file(ViewState *view) {
+    File *file = &view->file;
+
+    if (can_save_in_place(view)) {
+        return save_in_place(view);
+    }
+
+    // Devices and piped input have no path a rewritten copy could be renamed over
+    if (!file->regular) {
+        errno = file->writable ? EINVAL : EROFS;
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(file->fd, &info) || !save_as(view, file->name, info.st_mode)) {
+        return false;
+    }
+
+    // Our fd and mapping now belong to the replaced file
+    file->detached = true;
+    return true;
+}
+
+/*
+ * Opening
+ *
+ * Regular files are mapped when they fit, block devices are always paged,
+ * and streams we can't seek in (pipes, stdin) are spilled into an unlinked
+ * temp file first so they can be treated like any other file.
+ *
+ * A followed file gets a big range of address space held back for it and
+ * the file mapped over the front of that, so when it grows the new pages
+ * are mapped in right behind the old ones and the data pointer never
+ * moves under the workers reading it.
+ */
+
+#define SPILL_BUF_LEN (1024 * 1024)
+#define FOLLOW_RESERVE_LEN (1ULL << 40)
+
+// Set by --follow
+bool follow_mode = false;
+
+static int spill_to_temp(int in_fd) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir) {
+        dir = "/tmp";
+    }
+
+    int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+    if (fd < 0) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s/hexwrench.XXXXXX", dir);
+        fd = mkstemp(name);
+        if (fd >= 0) {
+            unlink(name);
+        }
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint8_t *buf = malloc(SPILL_BUF_LEN);
+    uint64_t offset = 0;
+    for (;;) {
+        ssize_t ret = read(in_fd, buf, SPILL_BUF_LEN);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 || (ret > 0 && !write_all(fd, offset, buf, ret))) {
+            close(fd);
+            fd = -1;
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+        offset += ret;
+    }
+
+    free(buf);
+    return fd;
+}
+
+bool open_file(File *file, char *name) {
+    *file = (File){.name = name, .fd = -1, .kind = SOURCE_MMAP};
+
+    if (!strcmp(name, "-")) {
+        file->name = "<stdin>";
+        file->fd = spill_to_temp(0);
+        if (file->fd < 0) {
+            printf("Failed to read stdin\n");
+            return false;
+        }
+    } else {
+        file->writable = true;
+        file->fd = open(name, O_RDWR, 0);
+        if (file->fd < 0 && (errno == EACCES || errno == EROFS || errno == EPERM)) {
+            file->writable = false;
+            file->fd = open(name, O_RDONLY, 0);
+        }
+        if (file->fd < 0) {
+            printf("Failed to open %s\n", name);
+            return false;
+        }
+    }
+
+    struct stat info;
+    if (fstat(file->fd, &info)) {
+        printf("Failed to get file info for %s\n", name);
+        return false;
+    }
+
+    if (S_ISBLK(info.st_mode)) {
+        if (ioctl(file->fd, BLKGETSIZE64, &file->size)) {
+            printf("Failed to get device size for %s\n", name);
+            return false;
+        }
+        file->kind = SOURCE_PAGED;
+    } else if (!S_ISREG(info.st_mode)) {
+        int spilled = spill_to_temp(file->fd);
+        if (spilled < 0 || fstat(spilled, &info)) {
+            printf("Failed to read %s\n", name);
+            return false;
+        }
+
+        close(file->fd);
+        file->fd = spilled;
+        file->writable = false;
+        file->size = info.st_size;
+    } else {
+        file->regular = strcmp(name, "-") != 0;
+        file->size = info.st_size;
+    }
+
+    // Anything too big to map falls back to paged reads
+    if (file->kind == SOURCE_MMAP && follow_mode) {
+        uint8_t *base = mmap(NULL, FOLLOW_RESERVE_LEN, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        file->data = base;
+        if (base != MAP_FAILED && file->size) {
+            file->data = mmap(base, file->size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file->fd, 0);
+        }
+        if (file->data == MAP_FAILED || file->size > FOLLOW_RESERVE_LEN) {
+            file->data = NULL;
+            file->kind = SOURCE_PAGED;
+        }
+    } else if (file->kind == SOURCE_MMAP && file->size) {
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (file->data == MAP_FAILED) {
+            file->data = NULL;
+            file->kind = SOURCE_PAGED;
+        }
+#ifdef MADV_HUGEPAGE
+        // Only takes where the kernel does huge pages for file mappings, elsewhere it's a no-op
+        if (file->data && use_hugepages) {
+            madvise(file->data, file->size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    if (file->kind == SOURCE_PAGED) {
+        page_cache_init(&file->cache, PAGE_CACHE_PAGES);
+    }
+    return true;
+}
+
+// Takes in bytes appended to a followed file, mapping only the pages that weren't mapped yet
+bool file_grow(File *file, uint64_t new_size) {
+    if (new_size <= file->size) {
+        return true;
+    }
+
+    if (file->kind == SOURCE_MMAP) {
+        if (new_size > FOLLOW_RESERVE_LEN) {
+            return false;
+        }
+
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t mapped = (file->size + page - 1) / page * page;
+        uint64_t needed = (new_size + page - 1) / page * page;
+        if (needed > mapped) {
+            if (mmap(file->data + mapped, needed - mapped, PROT_READ, MAP_PRIVATE | MAP_FIXED, file->fd, mapped) == MAP_FAILED) {
+                return false;
+            }
+#ifdef MADV_HUGEPAGE
+            if (use_hugepages) {
+                madvise(file->data + mapped, needed - mapped, MADV_HUGEPAGE);
+            }
+#endif
+        }
+    } else {
+        // The cached last page stopped at the old end
+        page_cache_clear(&file->cache);
+    }
+
+    // Published after the mapping, so a worker that sees the new size can read it
+    __atomic_store_n(&file->size, new_size, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Journal
+ *
+ * An interactive session on a regular file keeps a journal next to it
+ * (name.hwj), so a crash or a dropped connection doesn't take the edits
+ * with it. The journal opens with a checkpoint: the document's piece list
+ * followed by the bytes of every patch piece, laid out so it can be mapped
+ * back in and pointed into as is. Each edit after that is appended as a
+ * record. Undo and redo go in as the stretch of the document that differs
+ * from the version they left, and a replace-all as its pattern and
+ * replacement, which the replay searches for again. Once enough records
+ * pile up the whole journal is swapped for a fresh checkpoint.
+ *
+ * --resume maps the journal, builds the tree straight from the checkpoint
+ * and replays just the records after it. Each record carries a CRC32C of
+ * its payload and has its header written last, so one torn by a crash
+ * ends the replay instead of corrupting it. Quitting deletes the journal.
+ * Undo history doesn't survive a resume, it starts over from the resumed
+ * document.
+ */
+
+#define JOURNAL_MAGIC "HWJRNL1\n"
+#define JOURNAL_CHECKPOINT_EDITS 4096
+
+typedef struct {
+    char magic[8];
+
+    // The source the checkpoint was made against, resuming on top of anything else would be garbage
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} JournalHeader;
+
+typedef enum {
+    JOURNAL_CHECKPOINT = 1,
+    JOURNAL_INSERT,
+    JOURNAL_DELETE,
+    JOURNAL_OVERWRITE,
+    JOURNAL_FILL,
+    JOURNAL_PASTE,
+    JOURNAL_SPLICE,       // [offset, offset + len) swapped for the pieces that follow
+    JOURNAL_REPLACE_ALL,  // offset is how many matches, len how long the pattern is, the replacement follows it
+} JournalKind;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t crc;  // of the payload
+    uint64_t len;  // of the payload that follows
+} JournalRecord;
+
+// Payload of an edit record. Inserted or overwritten bytes, a fill's pattern or the pieces pasted or spliced in follow it unless they're a range of the source
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+    uint64_t source_start;  // UINT64_MAX when the bytes are in the record
+} JournalEdit;
+
+typedef enum {
+    JOURNAL_PIECE_SOURCE,
+    JOURNAL_PIECE_PATCH,
+    JOURNAL_PIECE_FILL,  // start is where one period of the pattern sits in the patch bytes
+} JournalPieceKind;
+
+// A checkpoint, a paste or a splice is a piece count, that many pieces, then the patch bytes they point into
+typedef struct {
+    uint64_t start;  // into the source, or into the patch bytes
+    uint64_t len;
+    uint32_t kind;
+    uint16_t fill_period;
+    uint16_t fill_phase;
+} JournalPiece;
+
+typedef struct {
+    char path[PATH_MAX];
+    int fd;
+    uint64_t end;    // where the next record goes
+    uint64_t edits;  // records since the checkpoint
+
+    // The record being written, its header goes in once the payload is down
+    SaveWriter w;
+    uint64_t record_start;
+    uint32_t crc;
+} Journal;
+
+Journal journal = {.fd = -1};
+
+static JournalHeader journal_header(struct stat *info) {
+    JournalHeader header = {
+        .dev = info->st_dev,
+        .ino = info->st_ino,
+        .size = info->st_size,
+        .mtime_sec = info->st_mtim.tv_sec,
+        .mtime_nsec = info->st_mtim.tv_nsec,
+    };
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    return header;
+}
+
+static void journal_begin(Journal *j, int fd, uint64_t offset) {
+    j->w.fd = fd;
+    j->w.offset = offset + sizeof(JournalRecord);
+    j->w.buf_len = 0;
+    j->record_start = offset;
+    j->crc = 0;
+}
+
+static bool journal_put(Journal *j, const void *data, uint64_t len) {
+    j->crc = crc32c_extend(j->crc, data, len);
+    return save_write(&j->w, (uint8_t *)data, len);
+}
+
+static bool journal_put_block(Journal *j, File *file, Block *b) {
+    for (uint64_t inner = 0; inner < b->len; ) {
+        uint64_t avail;
+        uint8_t *bytes = block_bytes(file, &file->cache, b, inner, &avail);
+        if (!avail || !journal_put(j, bytes, avail)) {
+            return false;
+        }
+        inner += avail;
+    }
+    return true;
+}
+
+// Whether a piece's bytes go in the journal, rather than where it sits in the source
+static bool journal_inlines(File *file, Block *b, bool inline_source) {
+    return b->patch || inline_source || file_overwritten(file, b->start, b->len);
+}
+
+static bool journal_end(Journal *j, JournalKind kind) {
+    if (!save_flush(&j->w)) {
+        return false;
+    }
+
+    JournalRecord record = {.kind = kind, .crc = j->crc, .len = j->w.offset - j->record_start - sizeof(record)};
+    return write_all(j->w.fd, j->record_start, (uint8_t *)&record, sizeof(record));
+}
+
+// Writes tree as a piece count, that many pieces, then the bytes the pieces that aren't the source's point into
+static bool journal_put_pieces(Journal *j, File *file, PieceTree *tree, bool inline_source) {
+    uint64_t count = piece_count(tree->root);
+    bool ok = journal_put(j, &count, sizeof(count));
+
+    // Pieces of one fill that edits split up share its pattern, which only goes in once
+    PieceIter it;
+    uint64_t data_len = 0;
+    uint8_t *last_tile = NULL;
+    uint64_t last_tile_start = 0;
+    for (piece_iter_seek(&it, tree, 0); ok && piece_iter_block(&it); piece_iter_next(&it)) {
+        Block *b = piece_iter_block(&it);
+        JournalPiece piece = {.start = data_len, .len = b->len, .kind = JOURNAL_PIECE_PATCH};
+        if (b->fill) {
+            if (b->data != last_tile) {
+                last_tile = b->data;
+                last_tile_start = data_len;
+                data_len += b->fill_period;
+            }
+            piece = (JournalPiece){
+                .start = last_tile_start,
+                .len = b->len,
+                .kind = JOURNAL_PIECE_FILL,
+                .fill_period = b->fill_period,
+                .fill_phase = b->fill_phase,
+            };
+        } else if (journal_inlines(file, b, inline_source)) {
+            data_len += b->len;
+        } else {
+            piece = (JournalPiece){.start = b->start, .len = b->len, .kind = JOURNAL_PIECE_SOURCE};
+        }
+        ok = journal_put(j, &piece, sizeof(piece));
+    }
+
+    last_tile = NULL;
+    for (piece_iter_seek(&it, tree, 0); ok && piece_iter_block(&it); piece_iter_next(&it)) {
+        Block *b = piece_iter_block(&it);
+        if (b->fill) {
+            ok = b->data == last_tile || journal_put(j, b->data, b->fill_period);
+            last_tile = b->data;
+        } else if (journal_inlines(file, b, inline_source)) {
+            ok = journal_put_block(j, file, b);
+        }
+    }
+
+    return ok;
+}
+
+// Replaces the journal with one holding only a checkpoint of tree, made against the source info describes
+static bool journal_write_checkpoint(Journal *j, File *file, PieceTree *tree, struct stat *info, bool inline_source) {
+    char tmp_name[PATH_MAX];
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", j->path) >= (int)sizeof(tmp_name)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    int fd = mkstemp(tmp_name);
+    if (fd < 0) {
+        return false;
+    }
+
+    JournalHeader header = journal_header(info);
+    bool ok = write_all(fd, 0, (uint8_t *)&header, sizeof(header));
+
+    journal_begin(j, fd, sizeof(header));
+    ok = ok && journal_put_pieces(j, file, tree, inline_source);
+    ok = ok && journal_end(j, JOURNAL_CHECKPOINT);
+    ok = ok && fdatasync(fd) == 0;
+    if (!ok || rename(tmp_name, j->path)) {
+        int err = errno;
+        close(fd);
+        unlink(tmp_name);
+        errno = err;
+        return false;
+    }
+
+    if (j->fd >= 0) {
+        close(j->fd);
+    }
+    j->fd = fd;
+    j->end = j->w.offset;
+    j->edits = 0;
+    return true;
+}
+
+// Gives up on journaling, a journal that stopped partway would only resume to the wrong document
+static void journal_fail(Journal *j, ViewState *view) {
+    snprintf(view->status, sizeof(view->status), "journal stopped: %s", strerror(errno));
+    close(j->fd);
+    unlink(j->path);
+    j->fd = -1;
+}
+
+// Checkpoints the current document
+void journal_checkpoint(Journal *j, ViewState *view) {
+    if (j->fd < 0) {
+        return;
+    }
+
+    /*
+     * Once a save has replaced the file, the pieces still point into the
+     * old copy, which can't be found again, so their bytes go in too.
+     */
+    File *file = &view->file;
+    struct stat info;
+    bool ok = file->detached ? !stat(file->name, &info) : !fstat(file->fd, &info);
+    if (!ok || !journal_write_checkpoint(j, file, &view->blocks, &info, file->detached)) {
+        journal_fail(j, view);
+    }
+}
+
+// After a save the document is just the file on disk again
+void journal_saved(Journal *j, ViewState *view) {
+    if (j->fd < 0) {
+        return;
+    }
+
+    struct stat info;
+    bool ok = view->file.detached ? !stat(view->file.name, &info) : !fstat(view->file.fd, &info);
+    if (!ok) {
+        journal_fail(j, view);
+        return;
+    }
+
+    // The piece is the file as it is on disk now, which what saves wrote over doesn't apply to
+    File disk = {.fd = -1, .size = info.st_size};
+    Block whole = file_block(0, info.st_size);
+    PieceTree tree = {.root = piece_build(&whole, 1)};
+    if (!journal_write_checkpoint(j, &disk, &tree, &info, false)) {
+        journal_fail(j, view);
+    }
+}
+
+static void journal_edit(Journal *j, ViewState *view, JournalKind kind, uint64_t offset, uint64_t len, Block *block, PieceTree *pieces) {
+    // An edit that left the document alone has nothing to replay. A splice comes after undo has already moved the version
+    if (j->fd < 0 || (kind != JOURNAL_SPLICE && !edit_pending(view))) {
+        return;
+    }
+
+    bool inline_bytes = block && journal_inlines(&view->file, block, view->file.detached);
+    JournalEdit edit = {.offset = offset, .len = len, .source_start = block && !inline_bytes ? block->start : UINT64_MAX};
+
+    journal_begin(j, j->fd, j->end);
+    bool ok = journal_put(j, &edit, sizeof(edit));
+    ok = ok && (!inline_bytes || journal_put_block(j, &view->file, block));
+    ok = ok && (!pieces || journal_put_pieces(j, &view->file, pieces, view->file.detached));
+    if (!ok || !journal_end(j, kind)) {
+        journal_fail(j, view);
+        return;
+    }
+    j->end = j->w.offset;
+
+    // Only when the pieces can still be written as they are, otherwise the replay is cheaper
+    j->edits++;
+    if (j->edits >= JOURNAL_CHECKPOINT_EDITS && !view->file.detached) {
+        journal_checkpoint(j, view);
+    }
+}
+
+void journal_insert(Journal *j, ViewState *view, uint64_t offset, Block block) {
+    journal_edit(j, view, JOURNAL_INSERT, offset, block.len, &block, NULL);
+}
+
+void journal_delete(Journal *j, ViewState *view, uint64_t offset, uint64_t len) {
+    journal_edit(j, view, JOURNAL_DELETE, offset, len, NULL, NULL);
+}
+
+void journal_overwrite(Journal *j, ViewState *view, uint64_t offset, const uint8_t *data, uint64_t len) {
+    Block block = new_block((uint8_t *)data, len, true);
+    journal_edit(j, view, JOURNAL_OVERWRITE, offset, len, &block, NULL);
+}
+
+void journal_fill(Journal *j, ViewState *view, uint64_t offset, uint64_t len, const uint8_t *pattern, uint64_t period) {
+    Block block = new_block((uint8_t *)pattern, period, true);
+    journal_edit(j, view, JOURNAL_FILL, offset, len, &block, NULL);
+}
+
+void journal_paste(Journal *j, ViewState *view, uint64_t offset, PieceTree *pieces) {
+    journal_edit(j, view, JOURNAL_PASTE, offset, piece_size(pieces->root), NULL, pieces);
+}
+
+void journal_replace_all(Journal *j, ViewState *view, const uint8_t *pattern, uint64_t pattern_len, Block repl, uint64_t count) {
+    uint8_t *bytes = malloc(pattern_len + repl.len);
+    if (!bytes) {
+        journal_fail(j, view);
+        return;
+    }
+    memcpy(bytes, pattern, pattern_len);
+    memcpy(bytes + pattern_len, repl.data, repl.len);
+
+    Block block = new_block(bytes, pattern_len + repl.len, true);
+    journal_edit(j, view, JOURNAL_REPLACE_ALL, count, pattern_len, &block, NULL);
+    free(bytes);
+}
+
+/*
+ * Undo and redo swap in a whole other tree, but the versions either side
+ * of an edit share everything outside it. Walking in from both ends to
+ * where the two stop reading the same bytes leaves just the edit to write
+ * out, which compaction merging pieces on one side doesn't get in the way of.
+ */
+void journal_splice(Journal *j, ViewState *view, PieceTree *before) {
+    if (j->fd < 0) {
+        return;
+    }
+
+    uint64_t old_len = piece_size(before->root);
+    uint64_t new_len = get_total_size(view);
+
+    PieceIter a, b;
+    uint64_t prefix = 0;
+    piece_iter_seek(&a, before, 0);
+    piece_iter_seek(&b, &view->blocks, 0);
+    while (piece_iter_block(&a) && piece_iter_block(&b) &&
+           pieces_same_bytes(piece_iter_block(&a), prefix - a.offset, piece_iter_block(&b), prefix - b.offset)) {
+        prefix = MIN(a.offset + piece_iter_block(&a)->len, b.offset + piece_iter_block(&b)->len);
+        if (prefix == a.offset + piece_iter_block(&a)->len) {
+            piece_iter_next(&a);
+        }
+        if (prefix == b.offset + piece_iter_block(&b)->len) {
+            piece_iter_next(&b);
+        }
+    }
+
+    // The suffix can't reach back into the prefix, on either side
+    uint64_t suffix = 0;
+    uint64_t suffix_max = MIN(old_len, new_len) - prefix;
+    piece_iter_seek_last(&a, before);
+    piece_iter_seek_last(&b, &view->blocks);
+    while (suffix < suffix_max && piece_iter_block(&a) && piece_iter_block(&b)) {
+        uint64_t a_end = old_len - suffix - a.offset;
+        uint64_t b_end = new_len - suffix - b.offset;
+        uint64_t step = MIN(MIN(a_end, b_end), suffix_max - suffix);
+        if (!pieces_same_bytes(piece_iter_block(&a), a_end - step, piece_iter_block(&b), b_end - step)) {
+            break;
+        }
+        suffix += step;
+        if (step == a_end) {
+            piece_iter_prev(&a);
+        }
+        if (step == b_end) {
+            piece_iter_prev(&b);
+        }
+    }
+
+    PieceTree pieces = copy_range(view, prefix, new_len - prefix - suffix);
+    journal_edit(j, view, JOURNAL_SPLICE, prefix, old_len - prefix - suffix, NULL, &pieces);
+}
+
+// Builds tree from what journal_put_pieces wrote, false if the pieces don't fit the payload or the source
+static bool journal_read_pieces(ViewState *view, uint8_t *payload, uint64_t len, PieceTree *tree, uint64_t *count_out) {
+    uint64_t count;
+    if (len < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, payload, sizeof(count));
+    if (count > (len - sizeof(count)) / sizeof(JournalPiece)) {
+        return false;
+    }
+
+    // A paste's pieces follow bytes of any length, so they're copied out rather than read in place
+    uint8_t *pieces = payload + sizeof(count);
+    uint8_t *data = pieces + count * sizeof(JournalPiece);
+    uint64_t data_len = len - sizeof(count) - count * sizeof(JournalPiece);
+
+    Block *blocks = malloc(MAX(count, 1) * sizeof(Block));
+    Block tile = {0};
+    uint64_t tile_start = UINT64_MAX;
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < count; i++) {
+        JournalPiece p;
+        memcpy(&p, pieces + i * sizeof(p), sizeof(p));
+        switch (p.kind) {
+            case JOURNAL_PIECE_SOURCE: {
+                ok = p.start <= view->file.size && p.len <= view->file.size - p.start;
+                blocks[i] = file_block(p.start, p.len);
+            } break;
+            case JOURNAL_PIECE_PATCH: {
+                ok = p.start <= data_len && p.len <= data_len - p.start;
+                blocks[i] = new_block(data + p.start, p.len, true);
+            } break;
+            case JOURNAL_PIECE_FILL: {
+                ok = p.fill_period && p.fill_period <= FILL_MAX_PERIOD && p.fill_phase < p.fill_period &&
+                     p.start <= data_len && p.fill_period <= data_len - p.start;
+                if (ok && (p.start != tile_start || p.fill_period != tile.fill_period)) {
+                    tile = fill_block(&view->add, data + p.start, p.fill_period, 0);
+                    tile_start = p.start;
+                    ok = tile.data;
+                }
+                blocks[i] = tile;
+                blocks[i].len = p.len;
+                blocks[i].fill_phase = p.fill_phase;
+            } break;
+            default: {
+                ok = false;
+            }
+        }
+    }
+
+    if (ok) {
+        tree->root = piece_build(blocks, count);
+        *count_out = count;
+    }
+    free(blocks);
+    return ok;
+}
+
+// Applies the edit record at *pos through the same calls that made it, false at the end or a torn record
+static bool journal_replay(ViewState *view, uint8_t *map, uint64_t map_len, uint64_t *pos) {
+    JournalRecord record;
+    JournalEdit edit;
+    if (map_len - *pos < sizeof(record) + sizeof(edit)) {
+        return false;
+    }
+
+    memcpy(&record, map + *pos, sizeof(record));
+    uint8_t *payload = map + *pos + sizeof(record);
+    if (record.len < sizeof(edit) || record.len > map_len - *pos - sizeof(record) ||
+        crc32c_extend(0, payload, record.len) != record.crc) {
+        return false;
+    }
+    memcpy(&edit, payload, sizeof(edit));
+
+    Block block = new_block(payload + sizeof(edit), record.len - sizeof(edit), true);
+    if (edit.source_start != UINT64_MAX) {
+        if (edit.source_start > view->file.size || edit.len > view->file.size - edit.source_start) {
+            return false;
+        }
+        block = file_block(edit.source_start, edit.len);
+    }
+
+    switch (record.kind) {
+        case JOURNAL_INSERT: {
+            if (block.len != edit.len) {
+                return false;
+            }
+            insert_data(view, edit.offset, block);
+        } break;
+        case JOURNAL_DELETE: {
+            delete_data(view, edit.offset, edit.len);
+        } break;
+        case JOURNAL_OVERWRITE: {
+            if (!block.patch || block.len != edit.len) {
+                return false;
+            }
+            overwrite_data(view, edit.offset, block.data, block.len);
+        } break;
+        case JOURNAL_FILL: {
+            if (!block.patch || !block.len || block.len > FILL_MAX_PERIOD) {
+                return false;
+            }
+            fill_data(view, edit.offset, edit.len, block.data, block.len);
+        } break;
+        case JOURNAL_PASTE: {
+            PieceTree pieces;
+            uint64_t count;
+            if (edit.source_start != UINT64_MAX || !journal_read_pieces(view, block.data, block.len, &pieces, &count) ||
+                piece_size(pieces.root) != edit.len) {
+                return false;
+            }
+            paste_data(view, edit.offset, &pieces);
+        } break;
+        case JOURNAL_SPLICE: {
+            PieceTree pieces;
+            uint64_t count;
+            uint64_t total_size = get_total_size(view);
+            if (edit.source_start != UINT64_MAX || edit.offset > total_size || edit.len > total_size - edit.offset ||
+                !journal_read_pieces(view, block.data, block.len, &pieces, &count)) {
+                return false;
+            }
+            delete_data(view, edit.offset, edit.len);
+            paste_data(view, edit.offset, &pieces);
+        } break;
+        case JOURNAL_REPLACE_ALL: {
+            // Searched for again, with the pattern standing in for the session's own search while it runs
+            if (!block.patch || !edit.len || edit.len > block.len || edit.len > sizeof(view->search)) {
+                return false;
+            }
+            uint8_t search[sizeof(view->search)];
+            uint64_t search_len = view->search_len;
+            memcpy(search, view->search, search_len);
+            memcpy(view->search, block.data, edit.len);
+            view->search_len = edit.len;
+
+            SearchJob job = {.wake_fds = {-1, -1}};
+            uint64_t count = 0, first = 0;
+            Block repl = new_block(block.data + edit.len, block.len - edit.len, true);
+            bool ok = replace_all(view, &job, repl, &count, &first) && count == edit.offset;
+            if (job.wake_fds[0] >= 0) {
+                close(job.wake_fds[0]);
+                close(job.wake_fds[1]);
+            }
+
+            memcpy(view->search, search, search_len);
+            view->search_len = search_len;
+            if (!ok) {
+                return false;
+            }
+        } break;
+        default: {
+            return false;
+        }
+    }
+
+    *pos += sizeof(record) + record.len;
+    return true;
+}
+
+static bool journal_resume(Journal *j, ViewState *view) {
+    int fd = open(j->path, O_RDWR);
+    if (fd < 0) {
+        printf("No journal to resume at %s\n", j->path);
+        return false;
+    }
+
+    struct stat journal_info, source_info;
+    if (fstat(fd, &journal_info) || fstat(view->file.fd, &source_info)) {
+        printf("Failed to get file info for %s\n", j->path);
+        return false;
+    }
+
+    // Stays mapped for the whole session, resumed patch pieces point into it
+    uint64_t map_len = journal_info.st_size;
+    uint8_t *map = map_len ? mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED || map_len < sizeof(JournalHeader) + sizeof(JournalRecord) + sizeof(uint64_t)) {
+        printf("%s is damaged\n", j->path);
+        return false;
+    }
+
+    JournalHeader header = journal_header(&source_info);
+    if (memcmp(map, &header, sizeof(header))) {
+        printf("%s has changed since %s was written\n", view->file.name, j->path);
+        return false;
+    }
+
+    JournalRecord record;
+    memcpy(&record, map + sizeof(header), sizeof(record));
+    uint8_t *payload = map + sizeof(header) + sizeof(record);
+    uint64_t payload_max = map_len - sizeof(header) - sizeof(record);
+
+    uint64_t count = 0;
+    bool ok = record.kind == JOURNAL_CHECKPOINT && record.len <= payload_max &&
+              crc32c_extend(0, payload, record.len) == record.crc;
+    piece_gen++;
+    if (!ok || !journal_read_pieces(view, payload, record.len, &view->blocks, &count)) {
+        printf("%s is damaged\n", j->path);
+        return false;
+    }
+
+    uint64_t pos = sizeof(header) + sizeof(record) + record.len;
+    uint64_t replayed = 0;
+    while (journal_replay(view, map, map_len, &pos)) {
+        replayed++;
+    }
+
+    // Whatever a crash tore off the end goes, so new records land right after the last good one
+    if (ftruncate(fd, pos)) {
+        printf("Failed to truncate %s\n", j->path);
+        return false;
+    }
+
+    j->fd = fd;
+    j->end = pos;
+    j->edits = replayed;
+    snprintf(view->status, sizeof(view->status), "resumed %llu pieces + %llu edits", count, replayed);
+    return true;
+}
+
+// Starts a journal for the document as loaded, or with resume picks up the one an earlier session left
+bool journal_open(Journal *j, ViewState *view, bool resume) {
+    checksum_init();
+    j->w = (SaveWriter){.buf = malloc(SAVE_BUF_LEN)};
+    if (snprintf(j->path, sizeof(j->path), "%s.hwj", view->file.name) >= (int)sizeof(j->path)) {
+        printf("No room for a journal path next to %s\n", view->file.name);
+        return false;
+    }
+
+    if (resume) {
+        return journal_resume(j, view);
+    }
+
+    if (!access(j->path, F_OK)) {
+        printf("%s was left by a session that didn't exit cleanly, recover it with --resume or delete it\n", j->path);
+        return false;
+    }
+
+    // Without a journal the session still works, it just isn't crash safe
+    struct stat info;
+    if (fstat(view->file.fd, &info) || !journal_write_checkpoint(j, &view->file, &view->blocks, &info, false)) {
+        snprintf(view->status, sizeof(view->status), "no journal: %s", strerror(errno));
+    }
+    return true;
+}
+
+// A clean exit leaves nothing to recover
+void journal_close(Journal *j) {
+    if (j->fd >= 0) {
+        close(j->fd);
+        unlink(j->path);
+        j->fd = -1;
+    }
+    free(j->w.buf);
+    j->w.buf = NULL;
+}
+
+/*
+ * Scripts
+ *
+ * --script applies a file of edits without ever touching the terminal.
+ * Offsets and lengths refer to the input as loaded (0x prefixes work) and
+ * bytes are written like search patterns, hex or "text":
+ *
+ *     insert    <offset> <bytes>
+ *     delete    <offset> <len>
+ *     overwrite <offset> <bytes>
+ *     fill      <offset> <len> <bytes>
+ *
+ * fill repeats its bytes over len without storing them more than once,
+ * or for a long pattern, without storing more than a 16 MiB run of it.
+ * Blank lines and # comments are skipped.
+ * The whole script is one batch, so edits may come in any order but can't
+ * overlap.
+ */
+
+static bool parse_number(char **str, uint64_t *value) {
+    char *c = *str + strspn(*str, " \t");
+    char *end;
+
+    errno = 0;
+    *value = strtoull(c, &end, 0);
+    if (end == c || errno || (*end && *end != ' ' && *end != '\t') || *c == '-') {
+        return false;
+    }
+
+    *str = end;
+    return true;
+}
+
+// Unlike a search, a typo here shouldn't quietly turn into text, so bad hex is an error
+static uint64_t parse_script_bytes(const char *str, uint8_t *buf) {
+    if (str[0] != '"') {
+        uint64_t nibbles = 0;
+        for (const char *c = str; *c; c++) {
+            if (*c == ' ') {
+                continue;
+            }
+            if (!strchr(hex_digits, *c | 0x20)) {
+                return 0;
+            }
+            nibbles++;
+        }
+        if (nibbles % 2) {
+            return 0;
+        }
+    }
+
+    return parse_pattern(str, buf, strlen(str));
+}
+
+// Slices a fill whose pattern is too long for a fill piece out of one run of whole periods this long
+#define SCRIPT_FILL_RUN_LEN (16 * 1024 * 1024)
+
+// Parses one line into the edits it makes, most lines make one. False for a bad line, or with errno ENOMEM when memory ran out
+static bool parse_edit(ViewState *view, char *line, uint64_t seq, EditArr *edits) {
+    char *c = line + strcspn(line, " \t");
+    if (*c) {
+        *c++ = 0;
+    }
+
+    bool insert = !strcmp(line, "insert");
+    bool delete = !strcmp(line, "delete");
+    bool overwrite = !strcmp(line, "overwrite");
+    bool fill = !strcmp(line, "fill");
+    if (!insert && !delete && !overwrite && !fill) {
+        return false;
+    }
+
+    Edit edit = {.seq = seq};
+    uint64_t len = 0;
+    if (!parse_number(&c, &edit.offset) || ((delete || fill) && !parse_number(&c, &len))) {
+        return false;
+    }
+    c += strspn(c, " \t");
+
+    if (delete) {
+        edit.len = len;
+        edit.block = new_block(NULL, 0, false);
+        if (*c || !len) {
+            return false;
+        }
+        ARR_APPEND(edits, edit);
+        return true;
+    }
+
+    uint8_t *bytes = malloc(strlen(c) + 1);
+    uint64_t bytes_len = parse_script_bytes(c, bytes);
+    if (!bytes_len || (fill && !len)) {
+        free(bytes);
+        return false;
+    }
+
+    uint64_t total_size = get_total_size(view);
+    if (fill && bytes_len > FILL_MAX_PERIOD) {
+        // Past the end there's nothing to slice, the batch reports it against this line
+        if (edit.offset > total_size || len > total_size - edit.offset) {
+            free(bytes);
+            edit.len = len;
+            edit.block = new_block(NULL, 0, false);
+            ARR_APPEND(edits, edit);
+            return true;
+        }
+
+        /*
+         * Each slice starts on a whole period, so they line up end to end,
+         * and side by side they're still one fill as far as the batch is
+         * concerned. Memory stays at one run however long the fill is.
+         */
+        uint64_t run_len = MIN(MAX(SCRIPT_FILL_RUN_LEN / bytes_len, 1) * bytes_len, len);
+        uint8_t *run = malloc(run_len);
+        Block block = new_block(NULL, 0, true);
+        if (run) {
+            for (uint64_t i = 0; i < run_len; i += bytes_len) {
+                memcpy(run + i, bytes, MIN(bytes_len, run_len - i));
+            }
+            block = add_bytes(&view->add, run, run_len);
+            free(run);
+        }
+        free(bytes);
+        if (!block.data) {
+            errno = ENOMEM;
+            return false;
+        }
+
+        for (uint64_t pos = 0; pos < len; pos += run_len) {
+            Edit slice = edit;
+            slice.offset += pos;
+            slice.len = MIN(run_len, len - pos);
+            slice.block = block_slice(block, 0, slice.len);
+            ARR_APPEND(edits, slice);
+        }
+        return true;
+    }
+
+    if (fill) {
+        edit.len = len;
+        edit.block = fill_block(&view->add, bytes, bytes_len, len);
+    } else {
+        edit.len = overwrite ? bytes_len : 0;
+        edit.block = add_bytes(&view->add, bytes, bytes_len);
+    }
+    free(bytes);
+
+    // Only a block that failed to allocate has no bytes behind it
+    if (!edit.block.data) {
+        errno = ENOMEM;
+        return false;
+    }
+    ARR_APPEND(edits, edit);
+    return true;
+}
+
+static bool write_output(ViewState *view, const char *out_name) {
+    if (!strcmp(out_name, "-")) {
+        return save_to_fd(view, 1);
+    }
+
+    // Writing over the input goes through the normal save so the pieces still reading it stay valid
+    struct stat in_info, out_info;
+    bool exists = stat(out_name, &out_info) == 0;
+    if (exists && fstat(view->file.fd, &in_info) == 0 &&
+        in_info.st_dev == out_info.st_dev && in_info.st_ino == out_info.st_ino) {
+        return save_file(view);
+    }
+
+    mode_t mask = umask(0);
+    umask(mask);
+    return save_as(view, out_name, exists ? out_info.st_mode : (0666 & ~mask));
+}
+
+bool run_script(ViewState *view, const char *script_name, const char *out_name) {
+    FILE *script = fopen(script_name, "r");
+    if (!script) {
+        fprintf(stderr, "Failed to open %s\n", script_name);
+        return false;
+    }
+
+    EditArr edits = {0};
+    char *line = NULL;
+    size_t line_cap = 0;
+    uint64_t line_no = 0;
+    bool ok = true;
+
+    while (ok && getline(&line, &line_cap, script) >= 0) {
+        line_no++;
+
+        char *c = line + strspn(line, " \t");
+        uint64_t len = strlen(c);
+        while (len && strchr(" \t\r\n", c[len - 1])) {
+            c[--len] = 0;
+        }
+        if (!len || c[0] == '#') {
             continue;
         }
 
-        // If there's range overlap
-        if (view_start <= block_end && block_start <= view_end) {
+        errno = 0;
+        ok = parse_edit(view, c, line_no, &edits);
+        if (!ok) {
+            fprintf(stderr, "%s:%llu: %s\n", script_name, line_no, errno == ENOMEM ? strerror(errno) : "bad edit");
+        }
+    }
+    free(line);
+    fclose(script);
+
+    Edit *bad = NULL;
+    if (ok && !apply_batch(view, &edits, &bad)) {
+        if (bad) {
+            fprintf(stderr, "%s:%llu: edit overlaps another or runs past the end\n", script_name, bad->seq);
+        } else {
+            fprintf(stderr, "Failed to apply %s: %s\n", script_name, strerror(errno));
+        }
+        ok = false;
+    }
+    free(edits.data);
+
+    if (ok) {
+        commit_edit(view, 0);
+        if (!write_output(view, out_name)) {
+            fprintf(stderr, "Failed to write %s: %s\n", out_name, strerror(errno));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+struct termios orig_termios;
+void cleanup_term(void) {
+    tcsetattr(0, TCSAFLUSH, &orig_termios);
+    set_mouse_reporting(false);
+    set_autowrap(true);
+    reset_scroll_region();
+    disable_altbuffer();
+    flush_out();
+}
+void init_term(void) {
+    // With the file piped in, keys have to come from the terminal itself
+    if (!isatty(0)) {
+        int tty = open("/dev/tty", O_RDWR);
+        if (tty < 0 || dup2(tty, 0) < 0) {
+            printf("Failed to open /dev/tty\n");
+            exit(1);
+        }
+        close(tty);
+    }
+
+    // Rows wider than the terminal get clipped at the edge instead of wrapping onto the next one
+    enable_altbuffer();
+    set_autowrap(false);
+    flush_out();
+
+    tcgetattr(0, &orig_termios);
+    atexit(cleanup_term);
+
+    struct termios raw = orig_termios;
+    raw.c_lflag &= ~(ECHO | ICANON);
+    tcsetattr(0, TCSAFLUSH, &raw);
+}
+
+
+bool get_term_size(Window *w) {
+    struct winsize ws;
+    if (ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        return false;
+    }
+
+    w->rows = ws.ws_row - 1;
+    w->cols = ws.ws_col;
+    return true;
+}
+
+
+ViewState view;
+
+// The second file in --diff mode, always scrolled along with the pane
+ViewState diff_view;
+bool diff_mode = false;
+
+/*
+ * Panes
+ *
+ * Ctrl-W splits the screen into panes onto the same document, all stacked
+ * or all side by side. Keys act on the focused pane. Each pane keeps the
+ * bytes and rows it drew last, and an edit marks only the panes whose
+ * visible range it reached, so the others aren't refetched or redrawn.
+ */
+
+#define MAX_PANES 4
+#define PANE_MIN_ROWS 3
+#define PANE_MIN_COLS 76
+
+Pane panes[MAX_PANES];
+int pane_count = 1;
+Pane *pane = &panes[0];
+bool panes_side_by_side = false;
+bool panes_moved = true;
+
+// Furthest a pane can scroll while still being filled
+uint64_t max_scroll_offset(Pane *p) {
+    uint64_t total_size = get_total_size(&view);
+    if (diff_mode) {
+        total_size = MAX(total_size, get_total_size(&diff_view));
+    }
+    return (uint64_t)MAX(0, (int64_t)(total_size - (total_size % 16)) - (int64_t)((p->rows - 1) * 16));
+}
+
+// Darker than the header, a row between stacked panes or a column between side by side ones
+static void draw_divider(int col, int row, int rows) {
+    for (int i = 0; i < rows; i++) {
+        set_cursor(col, row + i);
+        out_printf(panes_side_by_side ? "\x1b[48;5;236m \x1b[0m" : "\x1b[48;5;236m\x1b[2K\x1b[0m");
+    }
+}
+
+// What each of count panes gets of total rows or columns, once one between each pair has gone to a divider
+static uint64_t pane_share(uint64_t total, uint64_t count) {
+    return (total - MIN(total, count - 1)) / count;
+}
+
+// Shares the rows between the header and the prompt out again, and redraws everything, after a resize or split
+void layout_panes(void) {
+    static Window last;
+    if (!panes_moved && last.rows == view.w.rows && last.cols == view.w.cols) {
+        return;
+    }
+    panes_moved = false;
+    last = view.w;
+
+    reset_scroll_region();
+    clear_term();
+    screen_resize(&header_screen, 1);
+    screen_invalidate(&header_screen);
+
+    // Remainders go to the last pane, and one row or column between each pair is the divider
+    uint64_t data_rows = MAX(view.w.rows, 2) - 1;
+    uint64_t rows_each = MAX(pane_share(data_rows, pane_count), 1);
+    uint64_t cols_each = MAX(pane_share(view.w.cols, pane_count), 1);
+    int top = 2;
+    int left = 1;
+    for (int i = 0; i < pane_count; i++) {
+        Pane *p = &panes[i];
+        bool last_pane = i == pane_count - 1;
+        if (panes_side_by_side) {
+            p->rows = data_rows;
+            p->cols = last_pane ? MAX(view.w.cols - (left - 1), 1) : cols_each;
+        } else {
+            p->rows = last_pane ? MAX((int64_t)data_rows - (top - 2), 1) : rows_each;
+            p->cols = view.w.cols;
+        }
+
+        p->screen.top = top;
+        p->screen.left = left;
+        p->screen.width = pane_count > 1 && panes_side_by_side ? p->cols : 0;
+        screen_resize(&p->screen, p->rows);
+        screen_invalidate(&p->screen);
+
+        p->buffer_len = p->rows * 16;
+        p->buffer = realloc(p->buffer, p->buffer_len);
+        p->stale = true;
+        p->y = MIN(p->y, (int)p->rows - 1);
+
+        if (panes_side_by_side) {
+            left += p->cols;
+            if (!last_pane) {
+                draw_divider(left++, top, p->rows);
+            }
+        } else {
+            top += p->rows;
+            if (!last_pane) {
+                draw_divider(1, top++, 1);
+            }
+        }
+    }
+    view.updated = true;
+}
+
+// Opens a pane onto the same spot next to the focused one, turning every pane the way this one goes
+bool split_pane(bool side_by_side) {
+    uint64_t n = pane_count + 1;
+    uint64_t room = side_by_side ? pane_share(view.w.cols, n) : pane_share(MAX(view.w.rows, 2) - 1, n);
+    if (diff_mode || pane_count == MAX_PANES || room < (side_by_side ? PANE_MIN_COLS : PANE_MIN_ROWS)) {
+        return false;
+    }
+
+    int at = (pane - panes) + 1;
+    memmove(&panes[at + 1], &panes[at], (pane_count - at) * sizeof(Pane));
+    panes[at] = (Pane){.offset = pane->offset, .x = pane->x, .y = pane->y};
+    pane_count++;
+    pane = &panes[at];
+
+    panes_side_by_side = side_by_side;
+    panes_moved = true;
+    layout_panes();
+    return true;
+}
+
+void close_pane(void) {
+    if (pane_count == 1) {
+        return;
+    }
+
+    free(pane->buffer);
+    free(pane->screen.rows);
+    free(pane->screen.row_lens);
+
+    int at = pane - panes;
+    memmove(&panes[at], &panes[at + 1], (pane_count - at - 1) * sizeof(Pane));
+    pane_count--;
+    pane = &panes[MAX(at - 1, 0)];
+
+    panes_moved = true;
+    layout_panes();
+}
+
+// The pane drawn at a terminal cell, if any
+Pane *pane_at(int col, int row) {
+    for (int i = 0; i < pane_count; i++) {
+        Pane *p = &panes[i];
+        if (row >= p->screen.top && row < p->screen.top + (int)p->rows &&
+            col >= p->screen.left && col < p->screen.left + (int)p->cols) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// The document changed in [start, end), panes showing any of it fetch their bytes again
+void panes_touched(uint64_t start, uint64_t end) {
+    for (int i = 0; i < pane_count; i++) {
+        Pane *p = &panes[i];
+        if (start < p->offset + p->buffer_len && end > p->offset) {
+            p->stale = true;
+        }
+    }
+    view.updated = true;
+}
+
+// Puts the cursor on offset, scrolling only if it's off screen
+void goto_offset(uint64_t offset) {
+    uint64_t row_start = offset - (offset % 16);
+    if (row_start < pane->offset || row_start >= pane->offset + (pane->rows * 16)) {
+        pane->offset = MIN(row_start, max_scroll_offset(pane));
+        view.updated = true;
+    }
+
+    pane->y = (row_start - pane->offset) / 16;
+    pane->x = (offset % 16) * 2;
+}
+
+// The byte under a pane's cursor, x counts nibbles
+uint64_t pane_cursor(Pane *p) {
+    return p->offset + (p->y * 16) + (p->x / 2);
+}
+
+// Jumps to the next match at/after start (or the last one before it), waiting on the scan if needed
+void find_match(uint64_t start, bool forward) {
+    SearchJob *job = &search_job;
+    if (!job->chunks) {
+        search_start(job, &view);
+    }
+
+    uint64_t hit = 0;
+    job->pending = false;
+    switch (search_lookup(job, start, forward, &hit)) {
+        case LOOKUP_FOUND: {
+            bool wrapped = forward ? hit < start : hit >= start;
+            snprintf(view.status, sizeof(view.status), "match at %llx%s", hit, wrapped ? " (wrapped)" : "");
+            goto_offset(hit);
+        } break;
+        case LOOKUP_NONE: {
+            snprintf(view.status, sizeof(view.status), "pattern not found");
+        } break;
+        case LOOKUP_PENDING: {
+            job->pending = true;
+            job->pending_forward = forward;
+            job->pending_start = start;
+        } break;
+    }
+    view.updated = true;
+}
+
+// Picks up whatever the search workers finished since the last wakeup
+void search_update(SearchJob *job) {
+    char drain[64];
+    while (read(job->wake_fds[0], drain, sizeof(drain)) > 0);
+
+    if (job->running && search_finished(job)) {
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+
+    if (job->pending) {
+        find_match(job->pending_start, job->pending_forward);
+    }
+    view.updated = true;
+}
+
+// Jumps to the next (or previous) differing run, waiting on the diff workers if needed
+void find_diff(uint64_t start, bool forward) {
+    DiffJob *job = &diff_job;
+    if (!job->chunks) {
+        diff_start(job, &view, &diff_view);
+    }
+
+    uint64_t hit = 0;
+    job->pending = false;
+    switch (diff_lookup(job, start, forward, &hit)) {
+        case LOOKUP_FOUND: {
+            snprintf(view.status, sizeof(view.status), "difference at %llx", hit);
+            goto_offset(hit);
+        } break;
+        case LOOKUP_NONE: {
+            snprintf(view.status, sizeof(view.status), "no more differences");
+        } break;
+        case LOOKUP_PENDING: {
+            job->pending = true;
+            job->pending_forward = forward;
+            job->pending_start = start;
+        } break;
+    }
+    view.updated = true;
+}
+
+// Picks up whatever the diff workers finished since the last wakeup
+void diff_update(DiffJob *job) {
+    char drain[64];
+    while (read(job->wake_fds[0], drain, sizeof(drain)) > 0);
+
+    if (job->running && diff_finished(job)) {
+        for (int i = 0; i < job->thread_count; i++) {
+            pthread_join(job->threads[i], NULL);
+        }
+        job->running = false;
+    }
+
+    if (job->pending) {
+        find_diff(job->pending_start, job->pending_forward);
+    }
+    view.updated = true;
+}
+
+// Takes "<crc32c|sha256|xxh64|off> [start end]" from the hash prompt
+bool set_hash(char *query) {
+    char *c = query + strspn(query, " \t");
+    uint64_t name_len = strcspn(c, " \t");
+
+    int kind = -1;
+    for (int k = 0; k < (int)(sizeof(hash_names) / sizeof(hash_names[0])); k++) {
+        if (name_len == strlen(hash_names[k]) && !strncmp(c, hash_names[k], name_len)) {
+            kind = k;
+        }
+    }
+    c += name_len;
+
+    uint64_t start = 0;
+    uint64_t end = UINT64_MAX;
+    if (c[strspn(c, " \t")] && (!parse_number(&c, &start) || !parse_number(&c, &end) || c[strspn(c, " \t")] || start > end)) {
+        return false;
+    }
+    if (kind < 0) {
+        return false;
+    }
+
+    view.hash = kind;
+    view.hash_start = start;
+    view.hash_end = end;
+    if (kind == HASH_NONE) {
+        hash_stop(&hash_job);
+    } else if (kind == HASH_CRC32C && !crc_job.crcs) {
+        crc_start(&crc_job, &view.file);
+    }
+    return true;
+}
+
+// Restarts the hash if the document or range moved on since it started, so edits show up on the next redraw
+void hash_refresh(HashJob *job) {
+    if (!view.hash) {
+        return;
+    }
+
+    uint64_t total_size = get_total_size(&view);
+    uint64_t start = MIN(view.hash_start, total_size);
+    uint64_t end = MIN(view.hash_end, total_size);
+
+    // Compaction swaps the root without changing a byte, so only edits count
+    bool stale = job->kind != view.hash || job->edit_count != view.edit_count || job->start != start || job->end != end;
+    if (stale || (job->kind == HASH_CRC32C && !atomic_load(&job->done))) {
+        hash_start(job, &view, view.hash, start, end);
+    }
+}
+
+// "[sha256 1a2b...]", with the range if it isn't the whole document
+void format_hash_info(char *dst, uint64_t cap) {
+    HashJob *job = &hash_job;
+    dst[0] = 0;
+    if (!view.hash) {
+        return;
+    }
+    hash_refresh(job);
+
+    char range[48] = "";
+    if (view.hash_start || view.hash_end != UINT64_MAX) {
+        snprintf(range, sizeof(range), "%llx-%llx ", job->start, job->end);
+    }
+
+    if (atomic_load_explicit(&job->done, memory_order_acquire)) {
+        char digest[65] = "read failed";
+        for (uint64_t i = 0; i < job->digest_len; i++) {
+            digest[i * 2] = hex_digits[job->digest[i] >> 4];
+            digest[i * 2 + 1] = hex_digits[job->digest[i] & 0xF];
+            digest[i * 2 + 2] = 0;
+        }
+        snprintf(dst, cap, "[%s %s%s]", hash_names[job->kind], range, digest);
+    } else if (job->kind == HASH_CRC32C) {
+        uint64_t pct = (atomic_load(&crc_job.chunks_done) * 100) / MAX(crc_job.chunk_count, 1);
+        snprintf(dst, cap, "[%s %sscanning %llu%%]", hash_names[job->kind], range, pct);
+    } else {
+        uint64_t pct = (atomic_load(&job->hashed) * 100) / MAX(job->end - job->start, 1);
+        snprintf(dst, cap, "[%s %shashing %llu%%]", hash_names[job->kind], range, pct);
+    }
+}
+
+// Readahead past the viewport, in whichever direction it last scrolled
+#define PREFETCH_LEN (4 * 1024 * 1024)
+
+void prefetch_pane(Pane *p, int64_t scrolled) {
+    if (!scrolled) {
+        return;
+    }
+
+    uint64_t total_size = get_total_size(&view);
+    uint64_t start, end;
+    if (scrolled > 0) {
+        start = MIN(p->offset + p->buffer_len, total_size);
+        end = MIN(start + PREFETCH_LEN, total_size);
+    } else {
+        end = p->offset;
+        start = end - MIN(end, PREFETCH_LEN);
+    }
+
+    // Nothing new to ask for until the viewport eats into the near half of the last window
+    uint64_t half = (end - start) / 2;
+    uint64_t need_start = scrolled > 0 ? start : end - half;
+    uint64_t need_end = scrolled > 0 ? start + half : end;
+    if (need_start >= p->prefetch_start && need_end <= p->prefetch_end) {
+        return;
+    }
+
+    tree_advise(&view.blocks, &view.file, start, end, ADVISE_WILLNEED);
+    p->prefetch_start = start;
+    p->prefetch_end = end;
+}
+
+#define MINIMAP_MIN_COLS 80
+
+// Wide enough for both files' hex and ascii columns
+#define DIFF_WIDE_COLS 140
+
+// Scrolls so the minimap cell under a click or jump is at the top of the pane
+void minimap_jump(uint64_t cell) {
+    uint64_t data_rows = pane->rows;
+    uint64_t offset = cell * minimap_slice_len(get_total_size(&view), data_rows);
+    if (offset >= get_total_size(&view)) {
+        return;
+    }
+
+    pane->offset = MIN(offset, max_scroll_offset(pane));
+    view.updated = true;
+    goto_offset(offset);
+}
+
+// Moves to the next (or previous) cell whose class differs from the one the cursor is in
+void minimap_seek(uint64_t cursor, bool forward) {
+    uint64_t data_rows = pane->rows;
+    if (!data_rows) {
+        return;
+    }
+
+    MinimapCell *cells = malloc(data_rows * sizeof(MinimapCell));
+    minimap_cells(&minimap_job, &view, cells, data_rows, pane->offset, pane->offset + pane->buffer_len);
+
+    uint64_t here = MIN(cursor / minimap_slice_len(get_total_size(&view), data_rows), data_rows - 1);
+    for (uint64_t i = here; forward ? i + 1 < data_rows : i > 0; ) {
+        i = forward ? i + 1 : i - 1;
+        if (cells[i].kind != cells[here].kind && cells[i].kind != ' ') {
+            minimap_jump(i);
+            break;
+        }
+    }
+    free(cells);
+}
+
+/*
+ * Visual selection
+ *
+ * v anchors a selection at the cursor, which then runs to wherever the
+ * cursor goes, both ends included. y yanks it, x cuts it, and p or P put
+ * the clipboard back after or before the cursor. The clipboard holds
+ * pieces, the same nodes the document is built from, so yanking, cutting
+ * and pasting are a few tree splits and joins however much is selected.
+ * The bytes only get copied when a save writes them out. A paste is
+ * journaled as its pieces too, but the clipboard itself doesn't survive
+ * a resume.
+ */
+
+bool visual_mode;
+uint64_t visual_anchor;
+
+// The selection as [start, end), empty outside visual mode
+void selection_range(uint64_t cursor, uint64_t *start, uint64_t *end) {
+    uint64_t total_size = get_total_size(&view);
+    if (!visual_mode || !total_size) {
+        *start = 0;
+        *end = 0;
+        return;
+    }
+
+    *start = MIN(MIN(visual_anchor, cursor), total_size - 1);
+    *end = MIN(MAX(visual_anchor, cursor), total_size - 1) + 1;
+}
 
-            uint64_t start_offset = MAX((int64_t)view_start - (int64_t)block_start, 0);
-            uint64_t bytes_to_grab = MIN(len, b->len);
+void visual_start(uint64_t cursor) {
+    visual_mode = true;
+    visual_anchor = cursor;
+    snprintf(view.status, sizeof(view.status), "-- VISUAL --");
+    panes_touched(cursor, cursor + 1);
+}
 
-            //printf("buffer[0x%llx] | writing %llu bytes, from block[%llx]\n", accum_len, bytes_to_grab, start_offset);
-            memcpy(buffer + accum_len, b->data + start_offset, bytes_to_grab);
-            accum_len += bytes_to_grab;
-        }
+void visual_end(uint64_t cursor) {
+    uint64_t start, end;
+    selection_range(cursor, &start, &end);
+    visual_mode = false;
+    view.status[0] = '\0';
+    panes_touched(start, end);
+}
 
-        // If the block is past the view, or crosses the view end
-        if (block_start > view_end || block_end > view_end) {
-            return true;
-        }
+// Puts the selection on the clipboard, with cut taking it out of the document too, and leaves visual mode
+void yank_selection(uint64_t cursor, bool cut) {
+    uint64_t start, end;
+    selection_range(cursor, &start, &end);
+    visual_end(cursor);
+    if (start == end) {
+        return;
     }
 
-    return true;
+    view.clipboard = copy_range(&view, start, end - start);
+    if (cut) {
+        search_stop(&search_job);
+        diff_stop(&diff_job);
+        delete_data(&view, start, end - start);
+        journal_delete(&journal, &view, start, end - start);
+        commit_edit(&view, start);
+        panes_touched(start, UINT64_MAX);
+    }
+    snprintf(view.status, sizeof(view.status), "%s %llu bytes", cut ? "cut" : "yanked", end - start);
+    goto_offset(start);
 }
 
-struct termios orig_termios;
-void cleanup_term(void) {
-    tcsetattr(0, TCSAFLUSH, &orig_termios);
-    disable_altbuffer();
+void paste_clipboard(uint64_t offset) {
+    uint64_t len = piece_size(view.clipboard.root);
+    if (!len) {
+        snprintf(view.status, sizeof(view.status), "nothing yanked");
+        view.updated = true;
+        return;
+    }
+
+    search_stop(&search_job);
+    diff_stop(&diff_job);
+    offset = MIN(offset, get_total_size(&view));
+    paste_data(&view, offset, &view.clipboard);
+    journal_paste(&journal, &view, offset, &view.clipboard);
+    commit_edit(&view, offset);
+    panes_touched(offset, UINT64_MAX);
+    snprintf(view.status, sizeof(view.status), "pasted %llu bytes", len);
+    goto_offset(offset);
 }
-void init_term(void) {
-    enable_altbuffer();
 
-    tcgetattr(0, &orig_termios);
-    atexit(cleanup_term);
+/*
+ * Following
+ *
+ * --follow watches the file with inotify and takes in whatever gets
+ * appended to it, like tail -f. The new bytes go on the end of the
+ * document, after any local edits, and panes that were sitting at the end
+ * scroll along with them.
+ */
 
-    struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ECHO | ICANON);
-    tcsetattr(0, TCSAFLUSH, &raw);
+int follow_fd = -1;
+
+bool follow_start(File *file) {
+    follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return follow_fd >= 0 && inotify_add_watch(follow_fd, file->name, IN_MODIFY) >= 0;
 }
 
+void follow_update(void) {
+    // A burst of writes is one update, all that matters is the size at the end of it
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(follow_fd, events, sizeof(events)) > 0);
 
-bool get_term_size(Window *w) {
-    struct winsize ws;
-    if (ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    struct stat info;
+    if (view.file.detached || fstat(view.file.fd, &info) || (uint64_t)info.st_size == view.file.size) {
+        return;
+    }
+    if ((uint64_t)info.st_size < view.file.size) {
+        snprintf(view.status, sizeof(view.status), "file was truncated");
+        view.updated = true;
+        return;
+    }
+
+    bool at_end[MAX_PANES];
+    for (int i = 0; i < pane_count; i++) {
+        at_end[i] = panes[i].offset >= max_scroll_offset(&panes[i]);
+    }
+
+    uint64_t old_size = get_total_size(&view);
+    if (!file_grow(&view.file, info.st_size)) {
+        snprintf(view.status, sizeof(view.status), "can't follow past %llu bytes", view.file.size);
+        view.updated = true;
+        return;
+    }
+    version_catch_up(&view);
+    panes_touched(old_size, UINT64_MAX);
+
+    for (int i = 0; i < pane_count; i++) {
+        if (at_end[i]) {
+            panes[i].offset = max_scroll_offset(&panes[i]);
+        }
+    }
+}
+
+/*
+ * Input
+ *
+ * Whatever the terminal has sent is read in one go and decoded into keys
+ * from a buffer, so escape sequences (arrows, paging, mouse reports) come
+ * out whole, and the main loop only redraws once the buffer runs dry: a
+ * held key gets one redraw per batch of repeats instead of one each.
+ * SIGWINCH arrives through a signalfd polled next to the worker wake
+ * pipes rather than redrawing from inside a signal handler.
+ */
+
+enum {
+    KEY_ESC = 27,
+    KEY_UP = 0x100,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN,
+    KEY_HOME,
+    KEY_END,
+    KEY_MOUSE,
+    KEY_UNKNOWN,  // an escape sequence we don't handle, swallowed whole
+};
+
+typedef struct {
+    int code;
+
+    // KEY_MOUSE only, col and row count from 1
+    int button;
+    int col;
+    int row;
+    bool press;
+} Key;
+
+#define INPUT_BUF_LEN 4096
+
+// How long a lone ESC waits for the rest of a sequence before it's taken as the Esc key
+#define ESC_TIMEOUT_MS 25
+
+typedef struct {
+    uint8_t data[INPUT_BUF_LEN];
+    int start;
+    int len;
+} InputBuf;
+
+InputBuf input = {};
+int signal_fd = -1;
+
+// Blocks SIGWINCH and returns a signalfd for it, called before any thread starts so they all inherit the mask
+int open_signal_fd(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// Appends whatever is waiting on stdin (within timeout ms), false if nothing came
+static bool input_fill(int timeout) {
+    if (input.start) {
+        memmove(input.data, input.data + input.start, input.len);
+        input.start = 0;
+    }
+    if (input.len == INPUT_BUF_LEN) {
         return false;
     }
 
-    w->rows = ws.ws_row - 1;
-    w->cols = ws.ws_col;
+    struct pollfd pfd = {.fd = 0, .events = POLLIN};
+    if (poll(&pfd, 1, timeout) <= 0) {
+        return false;
+    }
+
+    ssize_t got = read(0, input.data + input.len, INPUT_BUF_LEN - input.len);
+    if (got <= 0) {
+        return false;
+    }
+    input.len += got;
     return true;
 }
 
+bool input_pending(void) {
+    return input.len > 0;
+}
 
-ViewState view;
-void update_buffer_size(void) {
-    uint64_t req_len = (view.w.rows - 1) * 16;
-    if (view.buffer_len != req_len) {
-        view.buffer_len = req_len;
-        view.buffer = realloc(view.buffer, view.buffer_len);
+// Decodes one key from the front of s, returns how many bytes it took or 0 if a sequence is cut short
+static int parse_key(const uint8_t *s, int len, Key *key) {
+    *key = (Key){.code = s[0]};
+    if (s[0] != KEY_ESC) {
+        return 1;
+    }
+    if (len < 2) {
+        return 0;
+    }
+    if (s[1] != '[' && s[1] != 'O') {
+        return 1;
+    }
+
+    // CSI/SS3: parameter and intermediate bytes, then a final byte in 0x40-0x7E
+    int end = 2;
+    while (end < len && (s[end] < 0x40 || s[end] > 0x7E)) {
+        end++;
+    }
+    if (end == len) {
+        return len < 32 ? 0 : 1;
+    }
+
+    char seq[32] = "";
+    memcpy(seq, s + 2, MIN(end - 2, (int)sizeof(seq) - 1));
+    char final = s[end];
+
+    char tail;
+    if (s[1] == '[' && seq[0] == '<' && (final == 'M' || final == 'm') &&
+        sscanf(seq + 1, "%d;%d;%d%c", &key->button, &key->col, &key->row, &tail) == 3) {
+        key->code = KEY_MOUSE;
+        key->press = final == 'M';
+        return end + 1;
+    }
+
+    switch (final) {
+        case 'A': key->code = KEY_UP;    break;
+        case 'B': key->code = KEY_DOWN;  break;
+        case 'C': key->code = KEY_RIGHT; break;
+        case 'D': key->code = KEY_LEFT;  break;
+        case 'H': key->code = KEY_HOME;  break;
+        case 'F': key->code = KEY_END;   break;
+        case '~': {
+            switch (atoi(seq)) {
+                case 1: case 7: key->code = KEY_HOME;      break;
+                case 4: case 8: key->code = KEY_END;       break;
+                case 5:         key->code = KEY_PAGE_UP;   break;
+                case 6:         key->code = KEY_PAGE_DOWN; break;
+                default:        key->code = KEY_UNKNOWN;   break;
+            }
+        } break;
+        default: {
+            key->code = KEY_UNKNOWN;
+        } break;
+    }
+    return end + 1;
+}
+
+// Takes the next buffered key, giving a cut off escape sequence a moment to finish arriving
+static bool next_key(Key *key) {
+    while (input.len) {
+        int used = parse_key(input.data + input.start, input.len, key);
+        if (!used && input_fill(ESC_TIMEOUT_MS)) {
+            continue;
+        }
+
+        // Nothing more came, so the ESC was just the Esc key
+        used = MAX(used, 1);
+        input.start += used;
+        input.len -= used;
+        if (!input.len) {
+            input.start = 0;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Waits for a key, returns false if it woke up for something else instead
+bool read_key(Key *key) {
+    if (next_key(key)) {
+        return true;
+    }
+
+    struct pollfd fds[8] = {{.fd = 0, .events = POLLIN}};
+    int nfds = 1;
+    int signal_idx = -1;
+    int follow_idx = -1;
+    int search_idx = -1;
+    int minimap_idx = -1;
+    int diff_idx = -1;
+    int crc_idx = -1;
+    int hash_idx = -1;
+    if (signal_fd >= 0) {
+        signal_idx = nfds;
+        fds[nfds++] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+    }
+    if (follow_fd >= 0) {
+        follow_idx = nfds;
+        fds[nfds++] = (struct pollfd){.fd = follow_fd, .events = POLLIN};
+    }
+    if (search_job.wake_fds[0] >= 0) {
+        search_idx = nfds;
+        fds[nfds++] = (struct pollfd){.fd = search_job.wake_fds[0], .events = POLLIN};
+    }
+    if (minimap_job.wake_fds[0] >= 0) {
+        minimap_idx = nfds;
+        fds[nfds++] = (struct pollfd){.fd = minimap_job.wake_fds[0], .events = POLLIN};
+    }
+    if (diff_job.wake_fds[0] >= 0) {
+        diff_idx = nfds;
+        fds[nfds++] = (struct pollfd){.fd = diff_job.wake_fds[0], .events = POLLIN};
+    }
+    if (crc_job.wake_fds[0] >= 0) {
+        crc_idx = nfds;
+        fds[nfds++] = (struct pollfd){.fd = crc_job.wake_fds[0], .events = POLLIN};
+    }
+    if (hash_job.wake_fds[0] >= 0) {
+        hash_idx = nfds;
+        fds[nfds++] = (struct pollfd){.fd = hash_job.wake_fds[0], .events = POLLIN};
+    }
+
+    // Leftover compaction work gets done whenever the user goes quiet for a bit
+    int timeout = view.compact_edits ? 250 : -1;
+    int ready = poll(fds, nfds, timeout);
+    if (ready <= 0) {
+        if (ready == 0) {
+            compact_step(&view, COMPACT_STEP_PIECES);
+        }
+        return false;
+    }
+
+    if (signal_idx >= 0 && (fds[signal_idx].revents & POLLIN)) {
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) > 0);
+        get_term_size(&view.w);
+        view.updated = true;
+        return false;
+    }
+    if (follow_idx >= 0 && (fds[follow_idx].revents & POLLIN)) {
+        follow_update();
+        return false;
+    }
+    if (search_idx >= 0 && (fds[search_idx].revents & POLLIN)) {
+        search_update(&search_job);
+        return false;
+    }
+    if (minimap_idx >= 0 && (fds[minimap_idx].revents & POLLIN)) {
+        minimap_update(&minimap_job);
+        view.updated = view.show_minimap;
+        return false;
+    }
+    if (diff_idx >= 0 && (fds[diff_idx].revents & POLLIN)) {
+        diff_update(&diff_job);
+        return false;
+    }
+    if (crc_idx >= 0 && (fds[crc_idx].revents & POLLIN)) {
+        crc_update(&crc_job);
+        view.updated = view.hash == HASH_CRC32C;
+        return false;
+    }
+    if (hash_idx >= 0 && (fds[hash_idx].revents & POLLIN)) {
+        hash_update(&hash_job);
         view.updated = true;
+        return false;
     }
+
+    input_fill(0);
+    return next_key(key);
 }
 
-void refresh_screen(void) {
-    if (view.updated) {
-        clear_term();
+// Reads a line of input on the bottom row, returns false if it was cancelled
+bool read_prompt(const char *label, char *buf, int cap) {
+    int len = 0;
+    buf[0] = 0;
+
+    bool done = false;
+    bool ok = false;
+    while (!done) {
+        set_cursor(1, view.w.rows + 1);
+        erase_line();
+        out_printf("%s%s", label, buf);
+        flush_out();
+
+        Key key;
+        if (!read_key(&key)) {
+            continue;
+        }
+
+        switch (key.code) {
+            case '\r':
+            case '\n': {
+                done = true;
+                ok = len > 0;
+            } break;
+            case KEY_ESC: {
+                done = true;
+            } break;
+            case 8:
+            case 127: {
+                if (len) {
+                    buf[--len] = 0;
+                }
+            } break;
+            default: {
+                if (key.code < 0x100 && is_printable(key.code) && len < cap - 1) {
+                    buf[len++] = key.code;
+                    buf[len] = 0;
+                }
+            } break;
+        }
     }
 
-    reset_cursor();
+    set_cursor(1, view.w.rows + 1);
+    erase_line();
+    return ok;
+}
+
+void print_stats_json(FILE *f) {
+    uint64_t pieces = piece_count(view.blocks.root);
+    fprintf(f, "{\n");
+    fprintf(f, "  \"pieces\": %llu,\n", pieces);
+    fprintf(f, "  \"nodes_allocated\": %llu,\n", stats.nodes);
+    fprintf(f, "  \"nodes_retained\": %llu,\n", stats.nodes - pieces);
+    fprintf(f, "  \"versions\": %llu,\n", view.history.len);
+    fprintf(f, "  \"add_bytes_used\": %llu,\n", view.add.used);
+    fprintf(f, "  \"add_bytes_allocated\": %llu,\n", view.add.allocated);
+    fprintf(f, "  \"bytes_copied\": %llu,\n", stats.copied);
+    fprintf(f, "  \"frames\": %llu,\n", stats.frames);
+    fprintf(f, "  \"frame_ns_total\": %llu,\n", stats.frame_ns);
+    fprintf(f, "  \"frame_ns_max\": %llu,\n", stats.frame_ns_max);
+    fprintf(f, "  \"term_writes\": %llu,\n", stats.term_writes);
+    fprintf(f, "  \"term_bytes\": %llu,\n", stats.term_bytes);
+    fprintf(f, "  \"disk_writes\": %llu,\n", stats.disk_writes);
+    fprintf(f, "  \"disk_bytes\": %llu,\n", stats.disk_bytes);
+    fprintf(f, "  \"preads\": %llu,\n", atomic_load(&stats.preads));
+    fprintf(f, "  \"pread_bytes\": %llu\n", atomic_load(&stats.pread_bytes));
+    fprintf(f, "}\n");
+}
+
+void print_stats_at_exit(void) {
+    print_stats_json(stderr);
+}
+
+// Drawn on the prompt row, outside the row cache, since it changes every frame anyway
+void draw_stats(void) {
+    uint64_t pieces = piece_count(view.blocks.root);
+
+    char line[ROW_MAX_LEN];
+    int len = snprintf(line, sizeof(line),
+        "pieces %llu (+%llu old)  add %lluK/%lluK  frame %lluus %llu writes %lluB  copied %lluB  preads %llu",
+        pieces, stats.nodes - pieces, view.add.used >> 10, view.add.allocated >> 10,
+        stats.last_frame_ns / 1000, stats.last_frame_writes, stats.last_frame_bytes,
+        stats.last_frame_copied, stats.last_frame_preads);
+    len = MIN(len, (int)MIN(sizeof(line) - 1, view.w.cols));
+
+    set_cursor(1, view.w.rows + 1);
+    erase_line();
+    out_printf("\x1b[7m%.*s\x1b[0m", len, line);
+}
+
+void refresh_screen(void) {
+    uint64_t frame_start = now_ns();
+    uint64_t writes = stats.term_writes;
+    uint64_t bytes = stats.term_bytes;
+    uint64_t preads = atomic_load(&stats.preads);
+    uint64_t copied = stats.copied;
+
+    layout_panes();
+
     if (view.updated) {
-        set_background(244);
-        set_foreground(232);
-        erase_line();
+        char search_info[48] = "";
+        if (search_job.chunks) {
+            uint64_t hits = atomic_load(&search_job.match_count);
+            if (search_job.running) {
+                uint64_t pct = (atomic_load(&search_job.chunks_done) * 100) / search_job.chunk_count;
+                snprintf(search_info, sizeof(search_info), "[searching %llu%%, %llu hits]", pct, hits);
+            } else {
+                snprintf(search_info, sizeof(search_info), "[%llu hits]", hits);
+            }
+        }
+
+        // Edits throw the diff away, so it gets rebuilt against the new tree here
+        if (diff_mode && !diff_job.chunks) {
+            diff_start(&diff_job, &view, &diff_view);
+        }
 
-        printf("%s -- %llu bytes\n", view.file.name, view.file.size);
+        char diff_info[48] = "";
+        if (diff_mode) {
+            uint64_t ranges = atomic_load(&diff_job.range_count);
+            if (diff_job.running) {
+                uint64_t pct = (atomic_load(&diff_job.chunks_done) * 100) / MAX(diff_job.chunk_count, 1);
+                snprintf(diff_info, sizeof(diff_info), "[diffing %llu%%, %llu ranges]", pct, ranges);
+            } else {
+                snprintf(diff_info, sizeof(diff_info), "[%llu differing ranges]", ranges);
+            }
+        }
+
+        char hash_info[128];
+        format_hash_info(hash_info, sizeof(hash_info));
+
+        char title[ROW_MAX_LEN - 32];
+        int title_len;
+        if (diff_mode) {
+            title_len = snprintf(title, MIN(sizeof(title), view.w.cols + 1), "%s vs %s -- %llu / %llu bytes  %s %s %s %s",
+                                 view.file.name, diff_view.file.name, get_total_size(&view), get_total_size(&diff_view),
+                                 view.status, hash_info, diff_info, search_info);
+        } else {
+            title_len = snprintf(title, MIN(sizeof(title), view.w.cols + 1), "%s -- %llu bytes  %s %s %s", view.file.name, view.file.size, view.status, hash_info, search_info);
+        }
+        title_len = MIN(title_len, (int)MIN(sizeof(title) - 1, view.w.cols));
+
+        char header[ROW_MAX_LEN];
+        int header_len = snprintf(header, sizeof(header), "\x1b[48;5;244m\x1b[38;5;232m\x1b[2K%.*s\x1b[0m", title_len, title);
+        emit_row(&header_screen, 0, header, header_len);
+
+        uint64_t sel_start, sel_end;
+        selection_range(pane_cursor(pane), &sel_start, &sel_end);
+
+        for (int i = 0; i < pane_count; i++) {
+            Pane *p = &panes[i];
+
+            // The minimap sits at the pane's right edge, as long as that's clear of the hex rows
+            MinimapCell *cells = NULL;
+            if (view.show_minimap && !diff_mode && p->cols >= MINIMAP_MIN_COLS) {
+                cells = malloc(MAX(p->rows, 1) * sizeof(MinimapCell));
+                minimap_cells(&minimap_job, &view, cells, p->rows, p->offset, p->offset + p->buffer_len);
+            }
+
+            // A pane nothing happened to already shows the right rows, diffs always follow the other file
+            int64_t scrolled = (int64_t)p->offset - (int64_t)p->screen.offset;
+            if (!scrolled && !p->stale && !cells && !diff_mode) {
+                continue;
+            }
+            prefetch_pane(p, scrolled);
 
-        reset_color();
-        update_buffer_size();
+            if (scrolled % 16 == 0) {
+                scroll_rows(&p->screen, scrolled / 16);
+            } else {
+                screen_invalidate(&p->screen);
+            }
+            p->screen.offset = p->offset;
+
+            if (scrolled || p->stale) {
+                get_data(&view, p->offset, p->buffer, p->buffer_len);
+                p->stale = false;
+            }
 
-        get_data(&view, view.offset, view.buffer, view.buffer_len);
-        print_view(view.buffer, view.buffer_len, get_total_size(&view), view.offset);
+            if (diff_mode) {
+                static uint8_t *diff_buffer;
+                diff_buffer = realloc(diff_buffer, p->buffer_len);
+                get_data(&diff_view, p->offset, diff_buffer, p->buffer_len);
+
+                uint64_t a_size = get_total_size(&view);
+                uint64_t b_size = get_total_size(&diff_view);
+                print_diff_view(&p->screen, p->buffer, a_size > p->offset ? a_size - p->offset : 0,
+                                diff_buffer, b_size > p->offset ? b_size - p->offset : 0,
+                                p->rows, p->offset, p->cols >= DIFF_WIDE_COLS);
+            } else {
+                int minimap_col = p->screen.left + p->cols - 3;
+                print_view(&p->screen, p->buffer, p->buffer_len, get_total_size(&view), p->offset, sel_start, sel_end, cells, minimap_col);
+            }
+            free(cells);
+        }
     }
 
-    int cluster_adj = view.x / 2;
-    int inner_adj = view.x % 2;
-    int cur_x = 11 + (cluster_adj * 3) + inner_adj;
+    int cluster_adj = pane->x / 2;
+    int inner_adj = pane->x % 2;
+    int cur_x = pane->screen.left + 10 + (cluster_adj * 3) + inner_adj;
+
+    if (view.show_stats) {
+        draw_stats();
+    }
 
-    set_cursor(cur_x, view.y + 2);
+    set_cursor(cur_x, pane->screen.top + pane->y);
+    flush_out();
     view.updated = false;
-}
 
-void handle_sigwinch(int unused) {
-    get_term_size(&view.w);
-    view.updated = true;
-    refresh_screen();
+    uint64_t frame_ns = now_ns() - frame_start;
+    stats.frames++;
+    stats.frame_ns += frame_ns;
+    stats.frame_ns_max = MAX(stats.frame_ns_max, frame_ns);
+    stats.last_frame_ns = frame_ns;
+    stats.last_frame_writes = stats.term_writes - writes;
+    stats.last_frame_bytes = stats.term_bytes - bytes;
+    stats.last_frame_preads = atomic_load(&stats.preads) - preads;
+    stats.last_frame_copied = stats.copied - copied;
 }
 
+// bench.c pulls in everything above for its own main
+#ifndef HEXWRENCH_NO_MAIN
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        printf("Expected %s <name of file>\n", argv[0]);
-        return 1;
+    char *file_name = NULL;
+    char *diff_name = NULL;
+    char *script_name = NULL;
+    char *out_name = NULL;
+    bool show_stats = false;
+    bool resume = false;
+    bool bad_args = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--script") && i + 1 < argc) {
+            script_name = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            out_name = argv[++i];
+        } else if (!strcmp(argv[i], "--stats")) {
+            show_stats = true;
+        } else if (!strcmp(argv[i], "--hugepages")) {
+            use_hugepages = true;
+        } else if (!strcmp(argv[i], "--follow")) {
+            follow_mode = true;
+        } else if (!strcmp(argv[i], "--resume")) {
+            resume = true;
+        } else if (!strcmp(argv[i], "--diff") && i + 2 < argc) {
+            file_name = argv[++i];
+            diff_name = argv[++i];
+        } else if (!file_name) {
+            file_name = argv[i];
+        } else {
+            bad_args = true;
+        }
     }
 
-    int fd = open(argv[1], O_RDONLY, 0);
-    if (fd < 0) {
-        printf("Failed to open %s\n", argv[1]);
+    bad_args |= (follow_mode || resume) && (diff_name || script_name);
+    bad_args |= follow_mode && resume;
+    if (bad_args || !file_name || !script_name != !out_name || (diff_name && script_name)) {
+        printf("Expected %s [--stats] [--hugepages] [--follow | --resume] <name of file, or - for stdin>\n", argv[0]);
+        printf("      or %s [--stats] [--hugepages] --script <edits> <file> -o <output, or - for stdout>\n", argv[0]);
+        printf("      or %s [--stats] [--hugepages] --diff <file> <other file>\n", argv[0]);
         return 1;
     }
 
-    struct stat info;
-    if (fstat(fd, &info)) {
-        printf("Failed to get file info for %s\n", argv[1]);
+    // Before anything starts a worker thread, or SIGWINCH could land on one of them instead
+    signal_fd = open_signal_fd();
+
+    File file;
+    if (!open_file(&file, file_name)) {
         return 1;
     }
-    uint64_t file_size = info.st_size;
-
-    uint8_t *file_bytes = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (file_bytes == MAP_FAILED) {
-        printf("Failed to map file %s\n", argv[1]);
+    if (follow_mode && !file.regular) {
+        printf("Only regular files can be followed\n");
+        return 1;
+    }
+    if (follow_mode && !follow_start(&file)) {
+        printf("Failed to watch %s\n", file_name);
         return 1;
     }
 
-    init_term();
+    // Registered before the terminal is set up, so it prints after it's been restored
+    if (show_stats) {
+        atexit(print_stats_at_exit);
+    }
 
     view = (ViewState){
-        .file = (File){.name = argv[1], .data = file_bytes, .size = file_size},
-        .x = 0,
-        .y = 0,
-        .buffer_len = 0,
-        .buffer = NULL,
+        .file = file,
         .updated = true
     };
-    ARR_APPEND(&view.blocks, new_block(view.file.data, view.file.size, false));
-    update_buffer_size();
+    insert_data(&view, 0, file_block(0, view.file.size));
+
+    // Only interactive sessions on a plain file get journaled, a followed one changes under it
+    if (resume && !view.file.regular) {
+        printf("Only regular files have a journal to resume\n");
+        return 1;
+    }
+    if (view.file.regular && !script_name && !diff_name && !follow_mode && !journal_open(&journal, &view, resume)) {
+        return 1;
+    }
+    commit_edit(&view, 0);
+
+    if (diff_name) {
+        diff_view = (ViewState){};
+        if (!open_file(&diff_view.file, diff_name)) {
+            return 1;
+        }
+        insert_data(&diff_view, 0, file_block(0, diff_view.file.size));
+        commit_edit(&diff_view, 0);
 
-    //insert_data(&view, 0, new_block_from_str("<3 "));
-    //insert_data(&view, 0, new_block_from_str(":) "));
+        diff_mode = true;
+        diff_start(&diff_job, &view, &diff_view);
+    }
+
+    if (script_name) {
+        return run_script(&view, script_name, out_name) ? 0 : 1;
+    }
+
+    init_term();
+
+    //insert_data(&view, 0, add_bytes(&view.add, (uint8_t *)"<3 ", 3));
+    //insert_data(&view, 0, add_bytes(&view.add, (uint8_t *)":) ", 3));
     //delete_data(&view, 1, 7);
 
     get_term_size(&view.w);
-    signal(SIGWINCH, handle_sigwinch);
 
     bool insert_mode = false;
     for (;;) {
-        refresh_screen();
-        char ch;
+        // Keys that are already queued get handled before the next redraw
+        if (!input_pending()) {
+            refresh_screen();
+        }
+        Key key;
 
     read_char:
-        read(0, &ch, 1);
+        if (!read_key(&key)) {
+            continue;
+        }
 
-        int max_rows = view.w.rows - 2;
-        uint64_t max_offset = (uint64_t)(MAX(0, (int64_t)(view.file.size - (view.file.size % 16)) - (int64_t)(max_rows * 16)));
+        int max_rows = pane->rows - 1;
+        uint64_t max_offset = max_scroll_offset(pane);
         int max_cols = 32;
 
-        int cursor_idx = ((view.y * max_cols) + view.x) / 2;
+        uint64_t cursor_idx = pane_cursor(pane);
 
         if (!insert_mode) {
-            switch (ch) {
+            switch (key.code) {
                 case 'q': {
+                    journal_close(&journal);
                     return 1;
                 } break;
 
                 // actions
                 case 'i': {
-                    insert_data(&view, cursor_idx, new_block_from_str("i"));
-                    view.updated = true;
+                    search_stop(&search_job);
+                    diff_stop(&diff_job);
+                    Block typed = add_bytes(&view.add, (uint8_t *)"i", 1);
+                    insert_data(&view, cursor_idx, typed);
+                    journal_insert(&journal, &view, cursor_idx, typed);
+                    commit_edit(&view, cursor_idx);
+                    panes_touched(cursor_idx, UINT64_MAX);
                 } break;
                 case 'x': {
+                    if (visual_mode) {
+                        yank_selection(cursor_idx, true);
+                        break;
+                    }
+                    search_stop(&search_job);
+                    diff_stop(&diff_job);
                     delete_data(&view, cursor_idx, 1);
+                    journal_delete(&journal, &view, cursor_idx, 1);
+                    commit_edit(&view, cursor_idx);
+                    panes_touched(cursor_idx, UINT64_MAX);
+                } break;
+                case 'r': {
+                    // Takes two hex digits for the new byte, anything else bails
+                    uint8_t byte = 0;
+                    bool valid = true;
+                    for (int i = 0; valid && i < 2; i++) {
+                        Key digit_key;
+                        while (!read_key(&digit_key));
+
+                        const char *digit = digit_key.code < 0x100 ? strchr(hex_digits, digit_key.code | 0x20) : NULL;
+                        valid = digit && digit_key.code;
+                        byte = (byte << 4) | (valid ? digit - hex_digits : 0);
+                    }
+
+                    if (valid) {
+                        search_stop(&search_job);
+                        diff_stop(&diff_job);
+                        overwrite_data(&view, cursor_idx, &byte, 1);
+                        journal_overwrite(&journal, &view, cursor_idx, &byte, 1);
+                        commit_edit(&view, cursor_idx);
+                        panes_touched(cursor_idx, cursor_idx + 1);
+                    }
+                } break;
+                case 'v': {
+                    if (visual_mode) {
+                        visual_end(cursor_idx);
+                    } else {
+                        visual_start(cursor_idx);
+                    }
+                } break;
+                case 'y': {
+                    if (visual_mode) {
+                        yank_selection(cursor_idx, false);
+                    }
+                } break;
+                case 'p':
+                case 'P': {
+                    paste_clipboard(key.code == 'p' ? cursor_idx + 1 : cursor_idx);
+                } break;
+                case 'u':
+                case 'R' & 0x1F: {
+                    uint64_t cursor = 0;
+                    PieceTree before = view.blocks;
+                    bool moved = (key.code == 'u') ? undo_edit(&view, &cursor) : redo_edit(&view, &cursor);
+                    if (moved) {
+                        search_stop(&search_job);
+                        diff_stop(&diff_job);
+                        journal_splice(&journal, &view, &before);
+                        panes_touched(0, UINT64_MAX);
+                        goto_offset(cursor);
+                    }
+                } break;
+                case 'm': {
+                    view.show_minimap = !view.show_minimap;
+                    if (view.show_minimap) {
+                        minimap_start(&minimap_job, &view.file);
+                    }
+                    set_mouse_reporting(view.show_minimap);
+
+                    // Rows are cached with their minimap cell, so hiding it means drawing them again
+                    panes_touched(0, UINT64_MAX);
+                } break;
+                case '[':
+                case ']': {
+                    if (view.show_minimap) {
+                        minimap_seek(cursor_idx, key.code == ']');
+                    }
+                } break;
+                case 's': {
+                    view.show_stats = !view.show_stats;
+                    if (!view.show_stats) {
+                        set_cursor(1, view.w.rows + 1);
+                        erase_line();
+                    }
+                } break;
+                case 'w': {
+                    if (save_file(&view)) {
+                        snprintf(view.status, sizeof(view.status), "wrote %llu bytes", get_total_size(&view));
+                        journal_saved(&journal, &view);
+
+                        // Saving in place rewrote source bytes the CRC table was built from
+                        if (crc_job.crcs && !view.file.detached) {
+                            crc_start(&crc_job, &view.file);
+                        }
+                    } else {
+                        snprintf(view.status, sizeof(view.status), "save failed: %s", strerror(errno));
+                    }
+                    view.updated = true;
+                } break;
+
+                case 'f': {
+                    // Same as a script fill: start, length, then hex or "text" to repeat over it
+                    char query[256];
+                    if (read_prompt("fill: ", query, sizeof(query))) {
+                        char *c = query;
+                        uint64_t start = 0, len = 0, period = 0;
+                        uint8_t pattern[sizeof(query)];
+                        if (parse_number(&c, &start) && parse_number(&c, &len)) {
+                            period = parse_script_bytes(c + strspn(c, " \t"), pattern);
+                        }
+
+                        if (len && period && period <= FILL_MAX_PERIOD && start < get_total_size(&view)) {
+                            search_stop(&search_job);
+                            diff_stop(&diff_job);
+                            fill_data(&view, start, len, pattern, period);
+                            journal_fill(&journal, &view, start, len, pattern, period);
+                            commit_edit(&view, start);
+                            panes_touched(start, start + len);
+                            goto_offset(start);
+                        } else {
+                            snprintf(view.status, sizeof(view.status), "usage: <start> <len> <hex or \"text\">");
+                        }
+                    }
+                    view.updated = true;
+                } break;
+                case '#': {
+                    char query[64];
+                    if (read_prompt("hash: ", query, sizeof(query)) && !set_hash(query)) {
+                        snprintf(view.status, sizeof(view.status), "usage: crc32c|sha256|xxh64|off [start end]");
+                    }
+                    view.updated = true;
+                } break;
+
+                // searching
+                case '/': {
+                    char query[256];
+                    if (read_prompt("/", query, sizeof(query))) {
+                        view.search_len = parse_pattern(query, view.search, sizeof(view.search));
+                        search_start(&search_job, &view);
+                        find_match(cursor_idx, true);
+                    }
+                    view.updated = true;
+                } break;
+                case 'R': {
+                    // Replacement is written like the search itself, and "" deletes every match
+                    char query[256];
+                    if (!view.search_len) {
+                        snprintf(view.status, sizeof(view.status), "search for something to replace first");
+                    } else if (read_prompt("replace all with: ", query, sizeof(query))) {
+                        uint8_t repl[sizeof(query)];
+                        uint64_t repl_len = parse_pattern(query, repl, sizeof(repl));
+
+                        diff_stop(&diff_job);
+                        uint64_t first = cursor_idx;
+                        uint64_t count = 0;
+                        Block block = add_bytes(&view.add, repl, repl_len);
+                        if (block.len != repl_len || !replace_all(&view, &search_job, block, &count, &first)) {
+                            snprintf(view.status, sizeof(view.status), "replace failed: %s", strerror(errno));
+                        } else {
+                            if (count) {
+                                journal_replace_all(&journal, &view, search_job.pat, search_job.pat_len, block, count);
+                                commit_edit(&view, first);
+                                panes_touched(first, UINT64_MAX);
+                                goto_offset(first);
+                            }
+                            snprintf(view.status, sizeof(view.status), "replaced %llu matches", count);
+                        }
+                    }
+                    view.updated = true;
+                } break;
+                case 'n': {
+                    if (view.search_len) {
+                        find_match(cursor_idx + 1, true);
+                    }
+                } break;
+                case 'N': {
+                    if (view.search_len) {
+                        find_match(cursor_idx, false);
+                    }
+                } break;
+                case 'd':
+                case 'D': {
+                    if (diff_mode) {
+                        find_diff(cursor_idx, key.code == 'd');
+                    }
+                } break;
+                case KEY_MOUSE: {
+                    // A click focuses the pane under it, and on its minimap column jumps there too
+                    Pane *clicked = key.press && key.button == 0 ? pane_at(key.col, key.row) : NULL;
+                    if (clicked) {
+                        pane = clicked;
+                        view.updated = true;
+                        if (view.show_minimap && pane->cols >= MINIMAP_MIN_COLS && key.col >= pane->screen.left + (int)pane->cols - 3) {
+                            minimap_jump(key.row - pane->screen.top);
+                        }
+                    }
+                } break;
+                case 'W' & 0x1F: {
+                    // Pane commands as in vim: s stacks a new pane, v puts one alongside, w cycles, c closes
+                    Key cmd;
+                    while (!read_key(&cmd));
+
+                    if ((cmd.code == 's' || cmd.code == 'v') && !split_pane(cmd.code == 'v')) {
+                        snprintf(view.status, sizeof(view.status), diff_mode ? "no splits while diffing" : "no room for another pane");
+                    } else if (cmd.code == 'w' || cmd.code == ('W' & 0x1F)) {
+                        pane = &panes[(pane - panes + 1) % pane_count];
+                    } else if (cmd.code == 'c' || cmd.code == 'q') {
+                        close_pane();
+                    }
                     view.updated = true;
                 } break;
+                case KEY_ESC: {
+                    if (visual_mode) {
+                        visual_end(cursor_idx);
+                    } else if (search_job.running) {
+                        search_stop(&search_job);
+                        snprintf(view.status, sizeof(view.status), "search cancelled");
+                        view.updated = true;
+                    }
+                } break;
 
                 // motions
-                case 'g': {
-                    view.y = 0;
+                case 'g':
+                case KEY_HOME: {
+                    pane->y = 0;
                     uint64_t new_offset = 0;
-                    if (view.offset != new_offset) {
-                        view.offset = new_offset;
+                    if (pane->offset != new_offset) {
+                        pane->offset = new_offset;
                         view.updated = true;
                     }
                 } break;
-                case 'G': {
-                    view.y = max_rows;
+                case 'G':
+                case KEY_END: {
+                    pane->y = max_rows;
                     uint64_t new_offset = max_offset;
-                    if (view.offset != new_offset) {
-                        view.offset = new_offset;
+                    if (pane->offset != new_offset) {
+                        pane->offset = new_offset;
                         view.updated = true;
                     }
                 } break;
-                case 'h': {
-                    view.x = MAX(view.x - 1, 0);
+                case 'h':
+                case KEY_LEFT: {
+                    pane->x = MAX(pane->x - 1, 0);
                 } break;
-                case 'l': {
-                    view.x = MIN(view.x + 1, max_cols - 1);
+                case 'l':
+                case KEY_RIGHT: {
+                    pane->x = MIN(pane->x + 1, max_cols - 1);
                 } break;
-                case 'k': {
-                    view.y = MAX(view.y - 1, 0);
-                    if (view.y - 1 < 0) {
-                        uint64_t new_offset = (uint64_t)MAX((int64_t)(view.offset - 16), 0);
-                        if (view.offset != new_offset) {
-                            view.offset = new_offset;
+                case 'k':
+                case KEY_UP: {
+                    pane->y = MAX(pane->y - 1, 0);
+                    if (pane->y - 1 < 0) {
+                        uint64_t new_offset = (uint64_t)MAX((int64_t)(pane->offset - 16), 0);
+                        if (pane->offset != new_offset) {
+                            pane->offset = new_offset;
                             view.updated = true;
                         }
                     }
                 } break;
-                case 'j': {
-                    view.y = MIN(view.y + 1, max_rows);
-                    if (view.y + 1 > max_rows) {
-                        uint64_t new_offset = MIN(view.offset + 16, max_offset);
-                        if (view.offset != new_offset) {
-                            view.offset = new_offset;
+                case 'j':
+                case KEY_DOWN: {
+                    pane->y = MIN(pane->y + 1, max_rows);
+                    if (pane->y + 1 > max_rows) {
+                        uint64_t new_offset = MIN(pane->offset + 16, max_offset);
+                        if (pane->offset != new_offset) {
+                            pane->offset = new_offset;
                             view.updated = true;
                         }
                     }
                 } break;
 
+                case KEY_PAGE_UP:
+                case KEY_PAGE_DOWN: {
+                    uint64_t page = (uint64_t)(max_rows + 1) * 16;
+                    uint64_t new_offset = (key.code == KEY_PAGE_DOWN) ? MIN(pane->offset + page, max_offset)
+                                                                      : pane->offset - MIN(pane->offset, page);
+                    if (pane->offset != new_offset) {
+                        pane->offset = new_offset;
+                        view.updated = true;
+                    }
+                } break;
+
                 // no clue, try again
                 default: {
                     goto read_char;
                 } break;
             }
+
+            // The selection follows the cursor, so the rows it moved across get drawn again
+            uint64_t moved_to = pane_cursor(pane);
+            if (visual_mode && moved_to != cursor_idx) {
+                panes_touched(MIN(moved_to, cursor_idx), MAX(moved_to, cursor_idx) + 1);
+            }
         }
     }
 }
+#endif